@@ -0,0 +1,38 @@
+/*
+ *  asm.c
+ *  Assembles an APEX program into a binary program image that
+ *  apex_sim maps directly as code memory
+ *
+ *  Author :
+ *  State University of New York, Binghamton
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cpu.h"
+
+int
+main(int argc, char const* argv[])
+{
+  if (argc != 3) {
+    fprintf(stderr, "APEX_Help : Usage %s <input_file> <image_file>\n", argv[0]);
+    exit(1);
+  }
+
+  int size = 0;
+  APEX_Instruction* code_memory = create_code_memory(argv[1], &size);
+  if (!code_memory) {
+    fprintf(stderr, "APEX_Error : Unable to assemble %s\n", argv[1]);
+    exit(1);
+  }
+
+  if (apex_image_write(argv[2], code_memory, size) != 0) {
+    fprintf(stderr, "APEX_Error : Unable to write %s\n", argv[2]);
+    free(code_memory);
+    exit(1);
+  }
+
+  fprintf(stderr, "APEX_ASM : Wrote %d instructions to %s\n", size, argv[2]);
+  free(code_memory);
+  return 0;
+}
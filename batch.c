@@ -0,0 +1,451 @@
+/*
+ *  batch.c
+ *  Runs a manifest of (program, cycle count) jobs on independent APEX
+ *  cpu instances spread over all cores, and writes per-job statistics
+ *  to one CSV or JSON file
+ *
+ *  Author :
+ *  State University of New York, Binghamton
+ */
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpu.h"
+
+/* Fields of a manifest line: the program, cycles and key=value pairs */
+#define MAX_MANIFEST_FIELDS 64
+
+/* A program shared read-only by every job that runs it */
+typedef struct Batch_Program
+{
+  char* filename;
+  APEX_Instruction* code_memory;
+  int code_memory_size;
+  void* mapping;
+  size_t mapping_size;
+} Batch_Program;
+
+/* One line of the manifest and its outcome */
+typedef struct Batch_Job
+{
+  int program;        // Index into the program table
+  long cycles_limit;  // Cycles to simulate, 0 to run to completion
+  APEX_Config config; // Microarchitecture of the job
+  int ok;             // Flag to indicate, the job ran without a fault
+  long cycles;        // Cycles simulated
+  int instructions;   // Instructions retired
+  int halted;         // Flag to indicate, the program finished
+  double seconds;     // Wall time of the simulation
+} Batch_Job;
+
+typedef struct Batch
+{
+  Batch_Program* programs;
+  int num_programs;
+  Batch_Job* jobs;
+  int num_jobs;
+} Batch;
+
+/*
+ * Double-ended task queue of one worker: the owner takes tasks from the
+ * tail, idle workers steal from the head
+ */
+typedef struct Task_Deque
+{
+  pthread_mutex_t lock;
+  int* tasks;
+  int head;
+  int tail;
+} Task_Deque;
+
+typedef struct Task_Pool
+{
+  Task_Deque* deques;
+  int num_workers;
+  void (*run)(void* ctx, int task);
+  void* ctx;
+} Task_Pool;
+
+typedef struct Task_Worker
+{
+  Task_Pool* pool;
+  int id;
+} Task_Worker;
+
+static int
+deque_pop(Task_Deque* dq, int steal)
+{
+  int task = -1;
+  pthread_mutex_lock(&dq->lock);
+  if (dq->head < dq->tail) {
+    task = steal ? dq->tasks[dq->head++] : dq->tasks[--dq->tail];
+  }
+  pthread_mutex_unlock(&dq->lock);
+  return task;
+}
+
+static void*
+worker_main(void* arg)
+{
+  Task_Worker* worker = arg;
+  Task_Pool* pool = worker->pool;
+
+  for (;;) {
+    int task = deque_pop(&pool->deques[worker->id], 0);
+    for (int k = 1; task < 0 && k < pool->num_workers; ++k) {
+      task = deque_pop(&pool->deques[(worker->id + k) % pool->num_workers], 1);
+    }
+    /* No task is ever added after start, so empty deques mean done */
+    if (task < 0) {
+      return NULL;
+    }
+    pool->run(pool->ctx, task);
+  }
+}
+
+/*
+ * Runs run(ctx, 0 .. num_tasks-1) on a work-stealing pool of threads.
+ * Each worker starts with a contiguous block of tasks
+ */
+static int
+run_pool(int num_workers, int num_tasks, void (*run)(void*, int), void* ctx)
+{
+  if (num_workers > num_tasks) {
+    num_workers = num_tasks > 0 ? num_tasks : 1;
+  }
+
+  Task_Pool pool = { calloc(num_workers, sizeof(Task_Deque)), num_workers,
+                     run, ctx };
+  Task_Worker* workers = calloc(num_workers, sizeof(*workers));
+  pthread_t* threads = calloc(num_workers, sizeof(*threads));
+  int* tasks = malloc(sizeof(int) * (num_tasks > 0 ? num_tasks : 1));
+  if (!pool.deques || !workers || !threads || !tasks) {
+    free(pool.deques);
+    free(workers);
+    free(threads);
+    free(tasks);
+    return -1;
+  }
+
+  for (int i = 0; i < num_tasks; ++i) {
+    tasks[i] = i;
+  }
+  for (int w = 0; w < num_workers; ++w) {
+    Task_Deque* dq = &pool.deques[w];
+    pthread_mutex_init(&dq->lock, NULL);
+    dq->tasks = tasks;
+    dq->head = (int)((long)num_tasks * w / num_workers);
+    dq->tail = (int)((long)num_tasks * (w + 1) / num_workers);
+    workers[w].pool = &pool;
+    workers[w].id = w;
+  }
+
+  int started = 0;
+  for (; started < num_workers; ++started) {
+    if (pthread_create(&threads[started], NULL, worker_main,
+                       &workers[started]) != 0) {
+      break;
+    }
+  }
+  /* Whatever could not be handed to a thread runs on this one */
+  if (started < num_workers) {
+    Task_Worker self = { &pool, started };
+    worker_main(&self);
+  }
+  for (int w = 0; w < started; ++w) {
+    pthread_join(threads[w], NULL);
+  }
+
+  for (int w = 0; w < num_workers; ++w) {
+    pthread_mutex_destroy(&pool.deques[w].lock);
+  }
+  free(pool.deques);
+  free(workers);
+  free(threads);
+  free(tasks);
+  return 0;
+}
+
+static double
+now_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+load_program(void* ctx, int task)
+{
+  Batch_Program* program = &((Batch*)ctx)->programs[task];
+  program->code_memory =
+    load_code_memory(program->filename, &program->code_memory_size,
+                     &program->mapping, &program->mapping_size);
+}
+
+static void
+run_job(void* ctx, int task)
+{
+  Batch* batch = ctx;
+  Batch_Job* job = &batch->jobs[task];
+  Batch_Program* program = &batch->programs[job->program];
+
+  APEX_CPU* cpu = APEX_cpu_create(program->code_memory,
+                                  program->code_memory_size, &job->config);
+  if (!cpu) {
+    return;
+  }
+
+  double start = now_seconds();
+  job->cycles = APEX_cpu_simulate(cpu, job->cycles_limit);
+  job->seconds = now_seconds() - start;
+  job->instructions = cpu->ins_completed;
+  job->halted = APEX_cpu_finished(cpu);
+  job->ok = !cpu->faulted;
+  APEX_cpu_stop(cpu);
+}
+
+static int
+find_program(Batch* batch, const char* filename)
+{
+  for (int i = 0; i < batch->num_programs; ++i) {
+    if (strcmp(batch->programs[i].filename, filename) == 0) {
+      return i;
+    }
+  }
+
+  Batch_Program* grown = realloc(
+    batch->programs, sizeof(*grown) * (batch->num_programs + 1));
+  if (!grown) {
+    return -1;
+  }
+  batch->programs = grown;
+  memset(&grown[batch->num_programs], 0, sizeof(*grown));
+  grown[batch->num_programs].filename = strdup(filename);
+  return batch->num_programs++;
+}
+
+/*
+ * Reads the manifest: one "<program> [cycles] [key=value ...]" job per
+ * line, with blank lines and '#' comments ignored. Missing cycles mean run
+ * to completion, and cycles are bounded by the int clock of the cpu;
+ * key=value pairs override the default microarchitecture. A line with
+ * more than MAX_MANIFEST_FIELDS fields is rejected
+ */
+static int
+read_manifest(Batch* batch, const char* filename)
+{
+  FILE* fp = fopen(filename, "r");
+  if (!fp) {
+    fprintf(stderr, "APEX_Error : Unable to open %s\n", filename);
+    return -1;
+  }
+
+  char* line = NULL;
+  size_t len = 0;
+  int line_num = 0;
+  int capacity = 0;
+  int status = 0;
+
+  while (status == 0 && getline(&line, &len, fp) != -1) {
+    const char* fields[MAX_MANIFEST_FIELDS];
+    int num_fields = 0;
+    int too_many = 0;
+    char* save;
+    line_num++;
+
+    line[strcspn(line, "#")] = '\0';
+    for (char* f = strtok_r(line, " \t\r\n", &save); f;
+         f = strtok_r(NULL, " \t\r\n", &save)) {
+      if (num_fields == MAX_MANIFEST_FIELDS) {
+        too_many = 1;
+        break;
+      }
+      fields[num_fields++] = f;
+    }
+    if (too_many) {
+      fprintf(stderr, "APEX_Error : %s:%d: more than %d fields\n", filename,
+              line_num, MAX_MANIFEST_FIELDS);
+      status = -1;
+      break;
+    }
+    if (!num_fields) {
+      continue;
+    }
+
+    APEX_Config config;
+    char* end = NULL;
+    long cycles = 0;
+    int first_pair = 1;
+    apex_config_default(&config);
+    if (num_fields > 1 && !strchr(fields[1], '=')) {
+      cycles = strtol(fields[1], &end, 10);
+      first_pair = 2;
+    }
+    if ((end && (*end != '\0' || cycles < 0 || cycles > INT_MAX)) ||
+        apex_config_args(&config, num_fields - first_pair,
+                         &fields[first_pair]) != num_fields - first_pair) {
+      fprintf(stderr,
+              "APEX_Error : %s:%d: expected <program> [cycles] "
+              "[key=value ...]\n",
+              filename, line_num);
+      status = -1;
+      break;
+    }
+
+    if (batch->num_jobs == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      Batch_Job* grown = realloc(batch->jobs, sizeof(*grown) * capacity);
+      if (!grown) {
+        status = -1;
+        break;
+      }
+      batch->jobs = grown;
+    }
+    Batch_Job* job = &batch->jobs[batch->num_jobs];
+    memset(job, 0, sizeof(*job));
+    job->program = find_program(batch, fields[0]);
+    job->cycles_limit = cycles;
+    job->config = config;
+    if (job->program < 0) {
+      status = -1;
+      break;
+    }
+    batch->num_jobs++;
+  }
+
+  free(line);
+  fclose(fp);
+  return status;
+}
+
+static void
+write_json_string(FILE* fp, const char* str)
+{
+  fputc('"', fp);
+  for (; *str; ++str) {
+    if (*str == '"' || *str == '\\') {
+      fputc('\\', fp);
+    }
+    fputc(*str, fp);
+  }
+  fputc('"', fp);
+}
+
+/* A quoted CSV field, with embedded quotes doubled */
+static void
+write_csv_string(FILE* fp, const char* str)
+{
+  fputc('"', fp);
+  for (; *str; ++str) {
+    if (*str == '"') {
+      fputc('"', fp);
+    }
+    fputc(*str, fp);
+  }
+  fputc('"', fp);
+}
+
+/*
+ * Writes one record per job, in manifest order. The format is JSON if
+ * the file name ends in ".json", CSV otherwise
+ */
+static int
+write_results(Batch* batch, const char* filename)
+{
+  FILE* fp = fopen(filename, "w");
+  if (!fp) {
+    fprintf(stderr, "APEX_Error : Unable to write %s\n", filename);
+    return -1;
+  }
+
+  size_t len = strlen(filename);
+  int json = len >= 5 && strcmp(filename + len - 5, ".json") == 0;
+
+  if (json) {
+    fprintf(fp, "[\n");
+  } else {
+    fprintf(fp, "job,program,cycles_limit,status,cycles,instructions,ipc,"
+                "halted,seconds\n");
+  }
+  for (int i = 0; i < batch->num_jobs; ++i) {
+    Batch_Job* job = &batch->jobs[i];
+    const char* program = batch->programs[job->program].filename;
+    double ipc = job->cycles ? (double)job->instructions / job->cycles : 0.0;
+
+    if (json) {
+      fprintf(fp, "  {\"job\": %d, \"program\": ", i);
+      write_json_string(fp, program);
+      fprintf(fp,
+              ", \"cycles_limit\": %ld, \"status\": \"%s\", \"cycles\": %ld, "
+              "\"instructions\": %d, \"ipc\": %.4f, \"halted\": %s, "
+              "\"seconds\": %.6f}%s\n",
+              job->cycles_limit, job->ok ? "ok" : "error", job->cycles,
+              job->instructions, ipc, job->halted ? "true" : "false",
+              job->seconds, i + 1 < batch->num_jobs ? "," : "");
+    } else {
+      fprintf(fp, "%d,", i);
+      write_csv_string(fp, program);
+      fprintf(fp, ",%ld,%s,%ld,%d,%.4f,%d,%.6f\n", job->cycles_limit,
+              job->ok ? "ok" : "error", job->cycles, job->instructions, ipc,
+              job->halted, job->seconds);
+    }
+  }
+  if (json) {
+    fprintf(fp, "]\n");
+  }
+  return fclose(fp) == 0 ? 0 : -1;
+}
+
+int
+main(int argc, char const* argv[])
+{
+  if (argc < 3 || argc > 4) {
+    fprintf(stderr,
+            "APEX_Help : Usage %s <manifest> <results.csv|results.json> "
+            "[threads]\n",
+            argv[0]);
+    exit(1);
+  }
+
+  int threads = argc == 4 ? atoi(argv[3]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  Batch batch;
+  memset(&batch, 0, sizeof(batch));
+  if (read_manifest(&batch, argv[1]) != 0) {
+    exit(1);
+  }
+
+  double start = now_seconds();
+  run_pool(threads, batch.num_programs, load_program, &batch);
+  for (int i = 0; i < batch.num_programs; ++i) {
+    if (!batch.programs[i].code_memory) {
+      fprintf(stderr, "APEX_Error : Unable to load %s\n",
+              batch.programs[i].filename);
+    }
+  }
+  run_pool(threads, batch.num_jobs, run_job, &batch);
+  double elapsed = now_seconds() - start;
+
+  int status = write_results(&batch, argv[2]);
+  fprintf(stderr, "APEX_BATCH : Ran %d jobs over %d programs on %d threads "
+                  "in %.3f s\n",
+          batch.num_jobs, batch.num_programs, threads, elapsed);
+
+  for (int i = 0; i < batch.num_programs; ++i) {
+    free_code_memory(batch.programs[i].code_memory, batch.programs[i].mapping,
+                     batch.programs[i].mapping_size);
+    free(batch.programs[i].filename);
+  }
+  free(batch.programs);
+  free(batch.jobs);
+  return status == 0 ? 0 : 1;
+}
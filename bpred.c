@@ -0,0 +1,234 @@
+/*
+ *  bpred.c
+ *  Contains the branch prediction unit used by fetch: a branch target
+ *  buffer and a choice of direction predictors, trained as branches
+ *  commit, with per-branch accuracy statistics
+ *
+ *  Author :
+ *
+ *  State University of New York, Binghamton
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+/* A direction predictor for BZ and BNZ that hit in the BTB */
+typedef struct Bpred_Ops
+{
+  const char* name;
+  int (*predict)(APEX_CPU* cpu, int pc, int target);
+  void (*train)(APEX_CPU* cpu, int pc, uint32_t ghr, int taken);
+} Bpred_Ops;
+
+static int
+counter_index(APEX_CPU* cpu, int pc, uint32_t ghr)
+{
+  uint32_t index = (uint32_t)pc / 4;
+  if (cpu->config.bpred == BPRED_GSHARE) {
+    index ^= ghr;
+  }
+  return index & ((1u << cpu->config.bpred_bits) - 1);
+}
+
+/* Backward taken, forward not taken */
+static int
+static_predict(APEX_CPU* cpu, int pc, int target)
+{
+  return target < pc;
+}
+
+static void
+static_train(APEX_CPU* cpu, int pc, uint32_t ghr, int taken)
+{
+}
+
+/* Bimodal and gshare share the table of 2-bit counters, and differ only
+ * in counter_index()
+ */
+static int
+counter_predict(APEX_CPU* cpu, int pc, int target)
+{
+  return cpu->bpred_counters[counter_index(cpu, pc, cpu->ghr)] >= 2;
+}
+
+static void
+counter_train(APEX_CPU* cpu, int pc, uint32_t ghr, int taken)
+{
+  uint8_t* counter = &cpu->bpred_counters[counter_index(cpu, pc, ghr)];
+  if (taken && *counter < 3) {
+    (*counter)++;
+  } else if (!taken && *counter > 0) {
+    (*counter)--;
+  }
+}
+
+static const Bpred_Ops bpred_ops[NUM_BPREDS] = {
+  [BPRED_STATIC] = { "static", static_predict, static_train },
+  [BPRED_BIMODAL] = { "bimodal", counter_predict, counter_train },
+  [BPRED_GSHARE] = { "gshare", counter_predict, counter_train },
+};
+
+static APEX_BTBEntry*
+btb_entry(APEX_CPU* cpu, int pc)
+{
+  return &cpu->btb[((uint32_t)pc / 4) % cpu->config.btb_size];
+}
+
+static uint32_t
+ghr_mask(APEX_CPU* cpu)
+{
+  return (1u << cpu->config.bpred_bits) - 1;
+}
+
+/*
+ * Allocates the predictor tables for the configured sizes, with an empty
+ * BTB and counters at weakly not taken
+ */
+int
+apex_bpred_create(APEX_CPU* cpu)
+{
+  int counters = 1 << cpu->config.bpred_bits;
+
+  cpu->btb = malloc(cpu->config.btb_size * sizeof(*cpu->btb));
+  cpu->bpred_counters = malloc(counters);
+  cpu->branch_stats = calloc(cpu->code_memory_size > 0 ? cpu->code_memory_size
+                                                       : 1,
+                             sizeof(*cpu->branch_stats));
+  if (!cpu->btb || !cpu->bpred_counters || !cpu->branch_stats) {
+    return -1;
+  }
+
+  for (int i = 0; i < cpu->config.btb_size; ++i) {
+    cpu->btb[i].pc = -1;
+    cpu->btb[i].target = 0;
+  }
+  memset(cpu->bpred_counters, 1, counters);
+  cpu->ghr = 0;
+  return 0;
+}
+
+void
+apex_bpred_free(APEX_CPU* cpu)
+{
+  free(cpu->btb);
+  free(cpu->bpred_counters);
+  free(cpu->branch_stats);
+}
+
+/*
+ * Predicts the pc to fetch after the instruction at 'pc'. Branches are
+ * only recognized once they are in the BTB: JUMP is then predicted taken,
+ * and BZ and BNZ as the direction predictor says, shifting the
+ * prediction into the global history. Sets 'shifted' if it did
+ */
+int
+apex_bpred_predict(APEX_CPU* cpu, int pc, int op, int* shifted)
+{
+  *shifted = 0;
+  if (op != OP_BZ && op != OP_BNZ && op != OP_JUMP) {
+    return pc + 4;
+  }
+
+  cpu->btb_lookups++;
+  APEX_BTBEntry* entry = btb_entry(cpu, pc);
+  if (entry->pc != pc) {
+    return pc + 4;
+  }
+  cpu->btb_hits++;
+
+  if (op == OP_JUMP) {
+    return entry->target;
+  }
+  int taken = bpred_ops[cpu->config.bpred].predict(cpu, pc, entry->target);
+  cpu->ghr = ((cpu->ghr << 1) | taken) & ghr_mask(cpu);
+  *shifted = 1;
+  return taken ? entry->target : pc + 4;
+}
+
+/*
+ * Repairs the global history after a mispredicted branch, from the
+ * history it was predicted with and its actual direction. A branch that
+ * did not shift the history at fetch (a JUMP, or any branch missing the
+ * BTB) leaves it as it was
+ */
+void
+apex_bpred_recover(APEX_CPU* cpu, uint32_t ghr, int shifted, int taken)
+{
+  if (shifted) {
+    cpu->ghr = ((ghr << 1) | taken) & ghr_mask(cpu);
+  } else {
+    cpu->ghr = ghr;
+  }
+}
+
+/*
+ * Trains the predictor with a committed branch: the direction counters
+ * with the history it was predicted with, and the BTB with its target
+ * when taken
+ */
+void
+apex_bpred_update(APEX_CPU* cpu, const rob* entry)
+{
+  if (entry->op != OP_JUMP) {
+    bpred_ops[cpu->config.bpred].train(cpu, entry->pc, entry->ghr,
+                                       entry->taken);
+  }
+  if (entry->taken) {
+    APEX_BTBEntry* btb = btb_entry(cpu, entry->pc);
+    btb->pc = entry->pc;
+    btb->target = entry->target;
+  }
+
+  int index = (entry->pc - 4000) / 4;
+  if (index >= 0 && index < cpu->code_memory_size) {
+    APEX_BranchStats* stats = &cpu->branch_stats[index];
+    stats->executed++;
+    stats->taken += entry->taken;
+    stats->mispredicted += entry->mispredicted;
+  }
+}
+
+static double
+percent(long part, long whole)
+{
+  return whole ? 100.0 * part / whole : 0.0;
+}
+
+/*
+ * Prints the accuracy of the predictor over all committed branches and
+ * for every static branch
+ */
+void
+apex_bpred_report(APEX_CPU* cpu)
+{
+  long executed = 0;
+  long mispredicted = 0;
+  for (int i = 0; i < cpu->code_memory_size; ++i) {
+    executed += cpu->branch_stats[i].executed;
+    mispredicted += cpu->branch_stats[i].mispredicted;
+  }
+
+  printf("\n");
+  printf("==================BRANCH PREDICTION==============\n");
+  printf(" | Predictor        | %s, %d BTB entries |\n",
+         bpred_ops[cpu->config.bpred].name, cpu->config.btb_size);
+  printf(" | Branches         | %ld |\n", executed);
+  printf(" | Mispredicted     | %ld (%.2f%% accuracy) |\n", mispredicted,
+         100.0 - percent(mispredicted, executed));
+  printf(" | BTB hits         | %ld of %ld lookups |\n", cpu->btb_hits,
+         cpu->btb_lookups);
+  printf(" | Squashed         | %ld instructions |\n", cpu->ins_squashed);
+
+  for (int i = 0; i < cpu->code_memory_size; ++i) {
+    const APEX_BranchStats* stats = &cpu->branch_stats[i];
+    if (stats->executed == 0) {
+      continue;
+    }
+    printf(" | pc(%d) %-9s | %ld executed, %.2f%% taken, %.2f%% accuracy |\n",
+           4000 + 4 * i, apex_op_info[cpu->code_memory[i].op].name,
+           stats->executed, percent(stats->taken, stats->executed),
+           100.0 - percent(stats->mispredicted, stats->executed));
+  }
+}
@@ -0,0 +1,437 @@
+/*
+ *  cache.c
+ *  Contains the data cache hierarchy behind the MEM units: set associative
+ *  L1D and L2 levels that model the latency of loads and stores, with
+ *  per-level hit, miss and eviction counters, and the MSHRs that let
+ *  loads and prefetches miss in the first level without blocking the MEM
+ *  units
+ *
+ *  Author :
+ *
+ *  State University of New York, Binghamton
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cpu.h"
+
+static const char* const policy_names[NUM_CACHE_POLICIES] = {
+  [CACHE_LRU] = "LRU",
+  [CACHE_FIFO] = "FIFO",
+  [CACHE_RANDOM] = "random",
+};
+
+static int
+cache_init(APEX_Cache* cache, const char* name, int size, int assoc, int line,
+           int policy, int latency)
+{
+  if (size % (assoc * line) != 0) {
+    fprintf(stderr,
+            "APEX_Error : %s size %d is not a multiple of %d ways of %d "
+            "words\n",
+            name, size, assoc, line);
+    return -1;
+  }
+
+  cache->name = name;
+  cache->sets = size / (assoc * line);
+  cache->assoc = assoc;
+  cache->line = line;
+  cache->policy = policy;
+  cache->latency = latency;
+  cache->lines = malloc(cache->sets * assoc * sizeof(*cache->lines));
+  if (!cache->lines) {
+    return -1;
+  }
+  for (int i = 0; i < cache->sets * assoc; ++i) {
+    cache->lines[i].tag = -1;
+    cache->lines[i].stamp = 0;
+    cache->lines[i].dirty = 0;
+    cache->lines[i].prefetched = 0;
+  }
+  return 0;
+}
+
+/*
+ * Builds the levels with a non-zero size, L1D first. Without any, memory
+ * is accessed at the fixed latency of the MEM units
+ */
+int
+apex_cache_create(APEX_CPU* cpu)
+{
+  const APEX_Config* config = &cpu->config;
+
+  cpu->num_caches = 0;
+  cpu->cache_tick = 0;
+  cpu->cache_rng = 2463534242u;
+  if (config->l1d_size > 0) {
+    if (cache_init(&cpu->caches[cpu->num_caches], "L1D", config->l1d_size,
+                   config->l1d_assoc, config->l1d_line, config->l1d_policy,
+                   config->l1d_latency) != 0) {
+      return -1;
+    }
+    cpu->num_caches++;
+  }
+  if (config->l2_size > 0) {
+    if (cache_init(&cpu->caches[cpu->num_caches], "L2", config->l2_size,
+                   config->l2_assoc, config->l2_line, config->l2_policy,
+                   config->l2_latency) != 0) {
+      return -1;
+    }
+    cpu->num_caches++;
+  }
+
+  /* MSHRs track L1D misses, so a hierarchy without an L1D blocks. The
+   * prefetchers, which need MSHRs, are off with them
+   */
+  cpu->num_mshrs = config->l1d_size > 0 ? config->mshrs : 0;
+  if (cpu->num_mshrs > 0) {
+    cpu->mshrs = malloc(cpu->num_mshrs * sizeof(*cpu->mshrs));
+    if (!cpu->mshrs) {
+      return -1;
+    }
+    for (int i = 0; i < cpu->num_mshrs; ++i) {
+      cpu->mshrs[i].line = -1;
+      cpu->mshrs[i].ready = 0;
+      cpu->mshrs[i].prefetch = 0;
+    }
+  }
+  return 0;
+}
+
+void
+apex_cache_free(APEX_CPU* cpu)
+{
+  for (int i = 0; i < APEX_CACHE_LEVELS; ++i) {
+    free(cpu->caches[i].lines);
+  }
+  free(cpu->mshrs);
+}
+
+/* The way of a full set to replace, by the policy of the level */
+static int
+victim(APEX_CPU* cpu, APEX_Cache* cache, APEX_CacheLine* set)
+{
+  if (cache->policy == CACHE_RANDOM) {
+    uint32_t x = cpu->cache_rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    cpu->cache_rng = x;
+    return x % cache->assoc;
+  }
+
+  /* LRU stamps lines on every access, FIFO only on a fill */
+  int way = 0;
+  for (int w = 1; w < cache->assoc; ++w) {
+    if ((int32_t)(set[w].stamp - set[way].stamp) < 0) {
+      way = w;
+    }
+  }
+  return way;
+}
+
+/*
+ * Looks up word 'address' in level 'level' and fills its line on a miss.
+ * A dirty line evicted is written back into the next level, which is not
+ * a 'demand' access counted as a hit or miss. Returns 1 on a hit
+ */
+static int
+cache_lookup(APEX_CPU* cpu, int level, int address, int write, int demand)
+{
+  APEX_Cache* cache = &cpu->caches[level];
+  int32_t tag = address / cache->line;
+  APEX_CacheLine* set = &cache->lines[(tag % cache->sets) * cache->assoc];
+  uint32_t tick = ++cpu->cache_tick;
+
+  for (int w = 0; w < cache->assoc; ++w) {
+    if (set[w].tag == tag) {
+      if (cache->policy == CACHE_LRU) {
+        set[w].stamp = tick;
+      }
+      set[w].dirty |= write;
+      cache->stats.hits += demand;
+      if (demand && set[w].prefetched) {
+        set[w].prefetched = 0;
+        cpu->prefetch_stats.useful++;
+      }
+      return 1;
+    }
+  }
+
+  int way = -1;
+  for (int w = 0; w < cache->assoc && way < 0; ++w) {
+    if (set[w].tag < 0) {
+      way = w;
+    }
+  }
+  if (way < 0) {
+    way = victim(cpu, cache, set);
+    cache->stats.evictions++;
+    cpu->prefetch_stats.unused += set[way].prefetched;
+    if (set[way].dirty) {
+      cache->stats.writebacks++;
+      if (level + 1 < cpu->num_caches) {
+        cache_lookup(cpu, level + 1, set[way].tag * cache->line, 1, 0);
+      }
+    }
+  }
+  set[way].tag = tag;
+  set[way].stamp = tick;
+  set[way].dirty = write;
+  set[way].prefetched = 0;
+  cache->stats.misses += demand;
+  return 0;
+}
+
+/* Looks up 'address' level by level, see apex_cache_access() */
+static int
+hierarchy_access(APEX_CPU* cpu, int address, int write, int demand)
+{
+  int cycles = 0;
+  for (int level = 0; level < cpu->num_caches; ++level) {
+    cycles += cpu->caches[level].latency;
+    if (cache_lookup(cpu, level, address, write, demand)) {
+      return cycles;
+    }
+  }
+  return cycles + cpu->config.memory_latency;
+}
+
+/*
+ * Accesses data memory word 'address' through the hierarchy, filling the
+ * line in every level that misses. Returns the cycles the access takes:
+ * the latency of every level up to the one that hits, plus memory_latency
+ * if none does. Without caches an access takes 1 cycle
+ */
+int
+apex_cache_access(APEX_CPU* cpu, int address, int write)
+{
+  if (cpu->num_caches == 0 || address < 0 ||
+      address >= cpu->config.data_memory_size) {
+    return 1;
+  }
+  return hierarchy_access(cpu, address, write, 1);
+}
+
+/* Returns the line of word 'address' in level 'level', or NULL */
+static APEX_CacheLine*
+cache_probe(APEX_CPU* cpu, int level, int address)
+{
+  APEX_Cache* cache = &cpu->caches[level];
+  int32_t tag = address / cache->line;
+  APEX_CacheLine* set = &cache->lines[(tag % cache->sets) * cache->assoc];
+
+  for (int w = 0; w < cache->assoc; ++w) {
+    if (set[w].tag == tag) {
+      return &set[w];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Scans the MSHRs for one filling 'line' in the first level. Returns its
+ * index, or -1 with a free MSHR in 'free_mshr' (-1 if none) and the
+ * number in use in 'busy'
+ */
+static int
+mshr_find(APEX_CPU* cpu, int32_t line, int* free_mshr, int* busy)
+{
+  *free_mshr = -1;
+  *busy = 0;
+  for (int i = 0; i < cpu->num_mshrs; ++i) {
+    APEX_Mshr* mshr = &cpu->mshrs[i];
+    if (mshr->ready <= cpu->clock) {
+      *free_mshr = i;
+    } else if (mshr->line == line) {
+      return i;
+    } else {
+      (*busy)++;
+    }
+  }
+  return -1;
+}
+
+static void
+mshr_fill(APEX_CPU* cpu, int i, int32_t line, int cycles, int busy,
+          int prefetch)
+{
+  APEX_MshrStats* stats = &cpu->mshr_stats;
+
+  cpu->mshrs[i].line = line;
+  cpu->mshrs[i].ready = cpu->clock + cycles - 1;
+  cpu->mshrs[i].prefetch = prefetch;
+  stats->busy_cycles += cycles - 1;
+  if (busy + 1 > stats->peak) {
+    stats->peak = busy + 1;
+  }
+}
+
+/*
+ * Loads data memory word 'address' through the MSHRs. A hit in the first
+ * level, or any access when the caches are blocking (no MSHRs), returns 1
+ * with the cycles it takes in 'cycles'. A miss takes a free MSHR, or
+ * merges into the one already filling its line, and returns 0 with the
+ * cycles the access takes up to the fill. Returns -1 if the load misses
+ * while every MSHR is in use, with the cycles up to the first one to
+ * free. In each case the data or the MSHR is there in the last of the
+ * 'cycles' cycles, counting the current one
+ *
+ * Note : The line is placed in the caches when the miss is taken, so a
+ * later access to it checks the MSHRs before the tags
+ */
+int
+apex_cache_load(APEX_CPU* cpu, int address, int* cycles)
+{
+  if (cpu->num_mshrs == 0 || address < 0 ||
+      address >= cpu->config.data_memory_size) {
+    *cycles = apex_cache_access(cpu, address, 0);
+    return 1;
+  }
+
+  APEX_MshrStats* stats = &cpu->mshr_stats;
+  int32_t line = address / cpu->caches[0].line;
+  int free_mshr;
+  int busy;
+  int i = mshr_find(cpu, line, &free_mshr, &busy);
+  if (i >= 0) {
+    APEX_Mshr* mshr = &cpu->mshrs[i];
+    stats->merged++;
+    cpu->caches[0].stats.misses++;
+    if (mshr->prefetch) {
+      APEX_CacheLine* filled = cache_probe(cpu, 0, address);
+      if (filled) {
+        filled->prefetched = 0;
+      }
+      mshr->prefetch = 0;
+      cpu->prefetch_stats.useful++;
+      cpu->prefetch_stats.late++;
+    }
+    *cycles = mshr->ready - cpu->clock + 1;
+    return 0;
+  }
+
+  if (cache_probe(cpu, 0, address)) {
+    *cycles = apex_cache_access(cpu, address, 0);
+    return 1;
+  }
+  if (free_mshr < 0) {
+    int32_t first_ready = INT32_MAX;
+    for (int m = 0; m < cpu->num_mshrs; ++m) {
+      if (cpu->mshrs[m].ready < first_ready) {
+        first_ready = cpu->mshrs[m].ready;
+      }
+    }
+    stats->full++;
+    *cycles = first_ready - cpu->clock + 1;
+    return -1;
+  }
+
+  *cycles = apex_cache_access(cpu, address, 0);
+  mshr_fill(cpu, free_mshr, line, *cycles, busy, 0);
+  stats->primary++;
+  return 0;
+}
+
+/*
+ * Prefetches the line of data memory word 'address' into the caches, in
+ * a free MSHR like a load miss but without counting as a demand access.
+ * Prefetches to lines present or being filled are ignored, and dropped
+ * when every MSHR is in use. Returns 1 if the prefetch was issued
+ *
+ * Note : Prefetches need MSHRs to be in flight, so blocking caches
+ * (mshrs 0) ignore them
+ */
+int
+apex_cache_prefetch(APEX_CPU* cpu, int address)
+{
+  if (cpu->num_mshrs == 0 || address < 0 ||
+      address >= cpu->config.data_memory_size) {
+    return 0;
+  }
+
+  int32_t line = address / cpu->caches[0].line;
+  int free_mshr;
+  int busy;
+  if (mshr_find(cpu, line, &free_mshr, &busy) >= 0 ||
+      cache_probe(cpu, 0, address)) {
+    return 0;
+  }
+  if (free_mshr < 0) {
+    cpu->prefetch_stats.dropped++;
+    return 0;
+  }
+
+  int cycles = hierarchy_access(cpu, address, 0, 0);
+  cache_probe(cpu, 0, address)->prefetched = 1;
+  mshr_fill(cpu, free_mshr, line, cycles, busy, 1);
+  cpu->prefetch_stats.issued++;
+  return 1;
+}
+
+static double
+percent(long part, long whole)
+{
+  return whole ? 100.0 * part / whole : 0.0;
+}
+
+/*
+ * Returns the MSHR cycles in use up to the current cycle. Each fill is
+ * charged in full when it is allocated, so the part of a fill still
+ * outstanding (one that ends after a HALT or a cycle limit) is taken off
+ */
+static long
+mshr_busy_cycles(const APEX_CPU* cpu)
+{
+  long busy = cpu->mshr_stats.busy_cycles;
+
+  for (int i = 0; i < cpu->num_mshrs; ++i) {
+    if (cpu->mshrs[i].ready > cpu->clock) {
+      busy -= cpu->mshrs[i].ready - cpu->clock;
+    }
+  }
+  return busy;
+}
+
+/*
+ * Prints the geometry and counters of every cache level
+ */
+void
+apex_cache_report(APEX_CPU* cpu)
+{
+  if (cpu->num_caches == 0) {
+    return;
+  }
+
+  printf("\n");
+  printf("==================DATA CACHE==============\n");
+  for (int i = 0; i < cpu->num_caches; ++i) {
+    const APEX_Cache* cache = &cpu->caches[i];
+    const APEX_CacheStats* stats = &cache->stats;
+    long accesses = stats->hits + stats->misses;
+    printf(" | %-4s geometry    | %d words, %d-way, %d-word lines, %s, %d "
+           "cycles |\n",
+           cache->name, cache->sets * cache->assoc * cache->line,
+           cache->assoc, cache->line, policy_names[cache->policy],
+           cache->latency);
+    printf(" | %-4s accesses    | %ld (%ld hits, %ld misses, %.2f%% hit "
+           "rate) |\n",
+           cache->name, accesses, stats->hits, stats->misses,
+           percent(stats->hits, accesses));
+    printf(" | %-4s evictions   | %ld (%ld written back) |\n", cache->name,
+           stats->evictions, stats->writebacks);
+  }
+  printf(" | Memory latency   | %d cycles |\n", cpu->config.memory_latency);
+
+  if (cpu->num_mshrs > 0) {
+    const APEX_MshrStats* stats = &cpu->mshr_stats;
+    printf(" | MSHRs            | %d (peak %d in use, %.2f on average) |\n",
+           cpu->num_mshrs, stats->peak,
+           cpu->clock ? (double)mshr_busy_cycles(cpu) / cpu->clock : 0.0);
+    printf(" | MSHR misses      | %ld primary, %ld merged, %ld retried "
+           "when full |\n",
+           stats->primary, stats->merged, stats->full);
+  }
+}
@@ -0,0 +1,314 @@
+/*
+ *  checkpoint.c
+ *  Contains functions to save the full state of an APEX cpu to a file and
+ *  to restore it, so a run can resume from a snapshot instead of
+ *  simulating its warm-up again
+ *
+ *  Author :
+ *
+ *  State University of New York, Binghamton
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+static const char checkpoint_magic[4] = { 'A', 'P', 'X', 'C' };
+
+/* Maximum number of state blocks in a checkpoint */
+#define MAX_CHECKPOINT_BLOCKS 64
+
+/* A piece of cpu state, saved and restored as raw bytes */
+typedef struct Checkpoint_Block
+{
+  void* data;
+  size_t size;
+} Checkpoint_Block;
+
+/*
+ * Lists the cpu state in file order. Everything except the code memory,
+ * the unit table and table pointers (rebuilt from the config) and the
+ * data memory, whose pages are written separately
+ *
+ * Note : State added to APEX_CPU must be added here to survive a restore
+ */
+static int
+checkpoint_blocks(APEX_CPU* cpu, Checkpoint_Block* blocks)
+{
+  int n = 0;
+#define BLOCK(ptr, bytes)                                                      \
+  blocks[n].data = (ptr);                                                      \
+  blocks[n].size = (bytes);                                                    \
+  n++
+
+  BLOCK(&cpu->clock, sizeof(cpu->clock));
+  BLOCK(&cpu->pc, sizeof(cpu->pc));
+  BLOCK(&cpu->haltflag, sizeof(cpu->haltflag));
+  BLOCK(&cpu->faulted, sizeof(cpu->faulted));
+  BLOCK(&cpu->fault_pc, sizeof(cpu->fault_pc));
+  BLOCK(&cpu->fault_address, sizeof(cpu->fault_address));
+  BLOCK(&cpu->LSQ_Instruction_flag, sizeof(cpu->LSQ_Instruction_flag));
+  BLOCK(cpu->regs, sizeof(cpu->regs));
+  BLOCK(&cpu->z_flag, sizeof(cpu->z_flag));
+  BLOCK(&cpu->z_rob, sizeof(cpu->z_rob));
+  BLOCK(&cpu->cdb_next, sizeof(cpu->cdb_next));
+  BLOCK(cpu->prf, cpu->config.prf_size * sizeof(int));
+  BLOCK(cpu->rename_table, sizeof(cpu->rename_table));
+  BLOCK(cpu->arch_map, sizeof(cpu->arch_map));
+  BLOCK(&cpu->free_count, sizeof(cpu->free_count));
+  BLOCK(&cpu->br_active, sizeof(cpu->br_active));
+  BLOCK(cpu->snapshots, sizeof(cpu->snapshots));
+  BLOCK(cpu->latches, 2 * cpu->num_stages * sizeof(CPU_Stage));
+  BLOCK(cpu->IQ, cpu->config.iq_size * sizeof(iq));
+  BLOCK(cpu->LSQ, cpu->config.lsq_size * sizeof(lsq));
+  BLOCK(cpu->ROB, cpu->config.rob_size * sizeof(rob));
+  BLOCK(&cpu->iq_count, sizeof(cpu->iq_count));
+  BLOCK(&cpu->dispatch_seq, sizeof(cpu->dispatch_seq));
+  BLOCK(&cpu->rob_head, sizeof(cpu->rob_head));
+  BLOCK(&cpu->rob_tail, sizeof(cpu->rob_tail));
+  BLOCK(&cpu->rob_count, sizeof(cpu->rob_count));
+  BLOCK(&cpu->lsq_head, sizeof(cpu->lsq_head));
+  BLOCK(&cpu->lsq_tail, sizeof(cpu->lsq_tail));
+  BLOCK(&cpu->lsq_count, sizeof(cpu->lsq_count));
+  BLOCK(cpu->bits, cpu->bits_words * sizeof(APEX_Bits));
+  BLOCK(cpu->btb, cpu->config.btb_size * sizeof(APEX_BTBEntry));
+  BLOCK(cpu->bpred_counters, (size_t)1 << cpu->config.bpred_bits);
+  BLOCK(&cpu->ghr, sizeof(cpu->ghr));
+  BLOCK(cpu->branch_stats, cpu->code_memory_size * sizeof(APEX_BranchStats));
+  BLOCK(&cpu->btb_lookups, sizeof(cpu->btb_lookups));
+  BLOCK(&cpu->btb_hits, sizeof(cpu->btb_hits));
+  for (int i = 0; i < cpu->num_caches; ++i) {
+    APEX_Cache* cache = &cpu->caches[i];
+    BLOCK(cache->lines, cache->sets * cache->assoc * sizeof(APEX_CacheLine));
+    BLOCK(&cache->stats, sizeof(cache->stats));
+  }
+  BLOCK(&cpu->cache_tick, sizeof(cpu->cache_tick));
+  BLOCK(&cpu->cache_rng, sizeof(cpu->cache_rng));
+  BLOCK(cpu->mshrs, cpu->num_mshrs * sizeof(APEX_Mshr));
+  BLOCK(&cpu->mshr_stats, sizeof(cpu->mshr_stats));
+  BLOCK(cpu->prefetch_table,
+        cpu->config.prefetch_table * sizeof(APEX_PrefetchEntry));
+  BLOCK(&cpu->prefetch_stats, sizeof(cpu->prefetch_stats));
+  BLOCK(&cpu->ins_completed, sizeof(cpu->ins_completed));
+  BLOCK(&cpu->ins_fast_forwarded, sizeof(cpu->ins_fast_forwarded));
+  BLOCK(&cpu->ins_squashed, sizeof(cpu->ins_squashed));
+  BLOCK(cpu->stalls, sizeof(cpu->stalls));
+
+#undef BLOCK
+  return n;
+}
+
+/*
+ * FNV-1a hash of the code memory, so a checkpoint is only restored into
+ * the program it was taken from
+ */
+static uint64_t
+code_hash(const APEX_CPU* cpu)
+{
+  const unsigned char* p = (const unsigned char*)cpu->code_memory;
+  size_t len = cpu->code_memory_size * sizeof(APEX_Instruction);
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; ++i) {
+    h = (h ^ p[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+static int
+read_header(FILE* fp, const char* filename, APEX_CheckpointHeader* header)
+{
+  if (fread(header, sizeof(*header), 1, fp) != 1 ||
+      memcmp(header->magic, checkpoint_magic, sizeof(checkpoint_magic)) != 0 ||
+      header->version != APEX_CHECKPOINT_VERSION) {
+    fprintf(stderr, "APEX_Error : %s is not a version %d checkpoint\n",
+            filename, APEX_CHECKPOINT_VERSION);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Saves the state of the cpu to a checkpoint file
+ *
+ * Note : Like program images, checkpoints are written in host byte order
+ */
+int
+APEX_cpu_checkpoint(APEX_CPU* cpu, const char* filename)
+{
+  FILE* fp = fopen(filename, "wb");
+  if (!fp) {
+    fprintf(stderr, "APEX_Error : Unable to create %s\n", filename);
+    return -1;
+  }
+
+  /* Data memory pages never written are not stored */
+  int num_pages = apex_memory_pages(cpu);
+
+  APEX_CheckpointHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, checkpoint_magic, sizeof(checkpoint_magic));
+  header.version = APEX_CHECKPOINT_VERSION;
+  header.bank = cpu->stage == cpu->latches ? 0 : 1;
+  header.config = cpu->config;
+  header.code_memory_size = cpu->code_memory_size;
+  header.code_hash = code_hash(cpu);
+  header.data_pages = cpu->pages_used;
+
+  Checkpoint_Block blocks[MAX_CHECKPOINT_BLOCKS];
+  int num_blocks = checkpoint_blocks(cpu, blocks);
+
+  int ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+  for (int i = 0; ok && i < num_blocks; ++i) {
+    ok = blocks[i].size == 0 ||
+         fwrite(blocks[i].data, blocks[i].size, 1, fp) == 1;
+  }
+  for (int i = 0; ok && i < num_pages; ++i) {
+    const int* page = apex_memory_page(cpu, i, 0);
+    if (page) {
+      uint32_t number = i;
+      ok = fwrite(&number, sizeof(number), 1, fp) == 1 &&
+           fwrite(page, sizeof(int), APEX_PAGE_WORDS, fp) == APEX_PAGE_WORDS;
+    }
+  }
+  if (fclose(fp) != 0) {
+    ok = 0;
+  }
+  if (!ok) {
+    fprintf(stderr, "APEX_Error : Unable to write %s\n", filename);
+  }
+  return ok ? 0 : -1;
+}
+
+/*
+ * Reads the microarchitecture parameters a checkpoint was taken with, to
+ * create a cpu it can be restored into
+ */
+int
+apex_checkpoint_config(const char* filename, APEX_Config* config)
+{
+  FILE* fp = fopen(filename, "rb");
+  if (!fp) {
+    fprintf(stderr, "APEX_Error : Unable to open %s\n", filename);
+    return -1;
+  }
+
+  APEX_CheckpointHeader header;
+  int status = read_header(fp, filename, &header);
+  fclose(fp);
+  if (status == 0) {
+    *config = header.config;
+  }
+  return status;
+}
+
+/*
+ * Restores a checkpoint into a cpu created for the same program with the
+ * same parameters. The cpu is left untouched if the checkpoint does not
+ * match it, is truncated or its data memory cannot be allocated
+ */
+int
+APEX_cpu_restore(APEX_CPU* cpu, const char* filename)
+{
+  FILE* fp = fopen(filename, "rb");
+  if (!fp) {
+    fprintf(stderr, "APEX_Error : Unable to open %s\n", filename);
+    return -1;
+  }
+
+  APEX_CheckpointHeader header;
+  if (read_header(fp, filename, &header) != 0) {
+    fclose(fp);
+    return -1;
+  }
+  if (memcmp(&header.config, &cpu->config, sizeof(header.config)) != 0 ||
+      header.code_memory_size != (uint32_t)cpu->code_memory_size ||
+      header.code_hash != code_hash(cpu) ||
+      header.data_pages > (uint32_t)apex_memory_pages(cpu) ||
+      header.bank > 1) {
+    fprintf(stderr,
+            "APEX_Error : %s was taken from another program or "
+            "configuration\n",
+            filename);
+    fclose(fp);
+    return -1;
+  }
+
+  /* Read into a copy first, so a truncated file leaves the cpu intact */
+  Checkpoint_Block blocks[MAX_CHECKPOINT_BLOCKS];
+  int num_blocks = checkpoint_blocks(cpu, blocks);
+  size_t page_size = sizeof(uint32_t) + APEX_PAGE_WORDS * sizeof(int);
+  size_t total = header.data_pages * page_size;
+  for (int i = 0; i < num_blocks; ++i) {
+    total += blocks[i].size;
+  }
+
+  char* buf = malloc(total);
+  if (!buf) {
+    fclose(fp);
+    return -1;
+  }
+  int ok = fread(buf, 1, total, fp) == total;
+  fclose(fp);
+  if (!ok) {
+    fprintf(stderr, "APEX_Error : %s is truncated\n", filename);
+    free(buf);
+    return -1;
+  }
+  const char* pages = buf + total - header.data_pages * page_size;
+  for (uint32_t i = 0; i < header.data_pages; ++i) {
+    uint32_t number;
+    memcpy(&number, pages + i * page_size, sizeof(number));
+    if (number >= (uint32_t)apex_memory_pages(cpu)) {
+      fprintf(stderr, "APEX_Error : %s has a page out of data memory\n",
+              filename);
+      free(buf);
+      return -1;
+    }
+  }
+
+  /* Data memory is rebuilt in a fresh page directory, which replaces the
+   * cpu's only once every page is allocated
+   */
+  APEX_PageTable** old_dir = cpu->page_dir;
+  int old_used = cpu->pages_used;
+  ok = apex_memory_create(cpu) == 0;
+  for (uint32_t i = 0; ok && i < header.data_pages; ++i) {
+    const char* p = pages + i * page_size;
+    uint32_t number;
+    memcpy(&number, p, sizeof(number));
+    int* page = apex_memory_page(cpu, number, 1);
+    if (page) {
+      memcpy(page, p + sizeof(number), APEX_PAGE_WORDS * sizeof(int));
+    }
+    ok = page != NULL;
+  }
+  if (!ok) {
+    /* Free the partial copy and keep the cpu's own memory */
+    apex_memory_free(cpu);
+    cpu->page_dir = old_dir;
+    cpu->pages_used = old_used;
+    fprintf(stderr, "APEX_Error : Unable to allocate data memory for %s\n",
+            filename);
+    free(buf);
+    return -1;
+  }
+  APEX_PageTable** new_dir = cpu->page_dir;
+  int new_used = cpu->pages_used;
+  cpu->page_dir = old_dir;
+  apex_memory_free(cpu);
+  cpu->page_dir = new_dir;
+  cpu->pages_used = new_used;
+
+  const char* p = buf;
+  for (int i = 0; i < num_blocks; ++i) {
+    memcpy(blocks[i].data, p, blocks[i].size);
+    p += blocks[i].size;
+  }
+  free(buf);
+
+  cpu->stage = cpu->latches + header.bank * cpu->num_stages;
+  cpu->next = cpu->latches + (1 - header.bank) * cpu->num_stages;
+  return 0;
+}
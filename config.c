@@ -0,0 +1,250 @@
+/*
+ *  config.c
+ *  Contains functions to set microarchitecture parameters from
+ *  "key = value" config files and command line overrides
+ *
+ *  Author :
+ *
+ *  State University of New York, Binghamton
+ */
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+/* A settable parameter and its legal range */
+typedef struct Config_Key
+{
+  const char* name;
+  size_t offset;
+  int min;
+  int max;
+} Config_Key;
+
+static const Config_Key config_keys[] = {
+  { "iq_size", offsetof(APEX_Config, iq_size), 1, 4096 },
+  { "lsq_size", offsetof(APEX_Config, lsq_size), 1, 4096 },
+  { "rob_size", offsetof(APEX_Config, rob_size), 1, 4096 },
+  { "prf_size", offsetof(APEX_Config, prf_size), NUM_ARCH_REGS + 1, 256 },
+  { "fetch_width", offsetof(APEX_Config, fetch_width), 1, 16 },
+  { "commit_width", offsetof(APEX_Config, commit_width), 1, 64 },
+  { "bpred", offsetof(APEX_Config, bpred), 0, NUM_BPREDS - 1 },
+  { "bpred_bits", offsetof(APEX_Config, bpred_bits), 1, 20 },
+  { "btb_size", offsetof(APEX_Config, btb_size), 1, 65536 },
+  { "branch_tags", offsetof(APEX_Config, branch_tags), 1,
+    APEX_MAX_BRANCH_TAGS },
+  { "cdb_width", offsetof(APEX_Config, cdb_width), 1, 64 },
+  { "cdb_policy", offsetof(APEX_Config, cdb_policy), 0, NUM_CDB_POLICIES - 1 },
+  { "int_units", offsetof(APEX_Config, int_units), 1, 16 },
+  { "int_latency", offsetof(APEX_Config, int_latency), 1, 64 },
+  { "int_pipelined", offsetof(APEX_Config, int_pipelined), 0, 1 },
+  { "mul_units", offsetof(APEX_Config, mul_units), 1, 16 },
+  { "mul_latency", offsetof(APEX_Config, mul_latency), 1, 64 },
+  { "mul_pipelined", offsetof(APEX_Config, mul_pipelined), 0, 1 },
+  { "mem_units", offsetof(APEX_Config, mem_units), 1, 16 },
+  { "mem_latency", offsetof(APEX_Config, mem_latency), 1, 64 },
+  { "mem_pipelined", offsetof(APEX_Config, mem_pipelined), 0, 1 },
+  { "l1d_size", offsetof(APEX_Config, l1d_size), 0, 1 << 24 },
+  { "l1d_assoc", offsetof(APEX_Config, l1d_assoc), 1, 64 },
+  { "l1d_line", offsetof(APEX_Config, l1d_line), 1, 256 },
+  { "l1d_policy", offsetof(APEX_Config, l1d_policy), 0,
+    NUM_CACHE_POLICIES - 1 },
+  { "l1d_latency", offsetof(APEX_Config, l1d_latency), 1, 1000 },
+  { "l2_size", offsetof(APEX_Config, l2_size), 0, 1 << 26 },
+  { "l2_assoc", offsetof(APEX_Config, l2_assoc), 1, 64 },
+  { "l2_line", offsetof(APEX_Config, l2_line), 1, 256 },
+  { "l2_policy", offsetof(APEX_Config, l2_policy), 0, NUM_CACHE_POLICIES - 1 },
+  { "l2_latency", offsetof(APEX_Config, l2_latency), 1, 1000 },
+  { "memory_latency", offsetof(APEX_Config, memory_latency), 1, 10000 },
+  { "mshrs", offsetof(APEX_Config, mshrs), 0, 64 },
+  { "prefetcher", offsetof(APEX_Config, prefetcher), 0, NUM_PREFETCHERS - 1 },
+  { "prefetch_degree", offsetof(APEX_Config, prefetch_degree), 1, 16 },
+  { "prefetch_table", offsetof(APEX_Config, prefetch_table), 1, 4096 },
+  { "data_memory_size", offsetof(APEX_Config, data_memory_size), 1, INT_MAX },
+};
+
+#define NUM_CONFIG_KEYS (sizeof(config_keys) / sizeof(config_keys[0]))
+
+/*
+ * Sets the parameters of the datapath in the project description
+ */
+void
+apex_config_default(APEX_Config* config)
+{
+  memset(config, 0, sizeof(*config));
+  config->iq_size = 8;
+  config->lsq_size = 6;
+  config->rob_size = 12;
+  config->prf_size = NUM_ARCH_REGS + 8;
+  config->fetch_width = 1;
+  config->commit_width = 1;
+  config->bpred = BPRED_BIMODAL;
+  config->bpred_bits = 10;
+  config->btb_size = 64;
+  config->branch_tags = 8;
+  config->cdb_width = 3;
+  config->cdb_policy = CDB_OLDEST;
+  config->int_units = 1;
+  config->int_latency = 2;
+  config->int_pipelined = 1;
+  config->mul_units = 1;
+  config->mul_latency = 3;
+  config->mul_pipelined = 1;
+  config->mem_units = 1;
+  config->mem_latency = 3;
+  config->mem_pipelined = 1;
+  config->l1d_size = 0;
+  config->l1d_assoc = 2;
+  config->l1d_line = 4;
+  config->l1d_policy = CACHE_LRU;
+  config->l1d_latency = 1;
+  config->l2_size = 0;
+  config->l2_assoc = 8;
+  config->l2_line = 8;
+  config->l2_policy = CACHE_LRU;
+  config->l2_latency = 10;
+  config->memory_latency = 100;
+  config->mshrs = 4;
+  config->prefetcher = PREFETCH_NONE;
+  config->prefetch_degree = 2;
+  config->prefetch_table = 64;
+  config->data_memory_size = 4096;
+}
+
+/*
+ * Sets one parameter by name. Returns -1 for an unknown key or a value
+ * that is not an integer within the key's range
+ */
+int
+apex_config_set(APEX_Config* config, const char* key, const char* value)
+{
+  for (size_t i = 0; i < NUM_CONFIG_KEYS; ++i) {
+    if (strcmp(config_keys[i].name, key) != 0) {
+      continue;
+    }
+
+    char* end;
+    errno = 0;
+    long v = strtol(value, &end, 0);
+    if (errno || end == value || *end != '\0' || v < config_keys[i].min ||
+        v > config_keys[i].max) {
+      fprintf(stderr, "APEX_Error : %s must be an integer in [%d, %d]\n", key,
+              config_keys[i].min, config_keys[i].max);
+      return -1;
+    }
+    *(int*)((char*)config + config_keys[i].offset) = (int)v;
+    return 0;
+  }
+
+  fprintf(stderr, "APEX_Error : unknown parameter %s\n", key);
+  return -1;
+}
+
+/*
+ * Applies a "key=value" override as given on the command line
+ */
+static int
+config_set_pair(APEX_Config* config, char* pair)
+{
+  char* eq = strchr(pair, '=');
+  if (!eq) {
+    return -1;
+  }
+
+  /* Trim blanks around key and value */
+  char* key = pair;
+  char* value = eq + 1;
+  char* end = eq;
+  *eq = '\0';
+  while (*key == ' ' || *key == '\t') {
+    key++;
+  }
+  while (end > key && (end[-1] == ' ' || end[-1] == '\t')) {
+    *--end = '\0';
+  }
+  while (*value == ' ' || *value == '\t') {
+    value++;
+  }
+  end = value + strlen(value);
+  while (end > value && strchr(" \t\r\n", end[-1])) {
+    *--end = '\0';
+  }
+  return apex_config_set(config, key, value);
+}
+
+/*
+ * Reads a config file of "key = value" lines. Blank lines and '#'
+ * comments are ignored; a bad line is reported with its line number
+ */
+int
+apex_config_load(APEX_Config* config, const char* filename)
+{
+  FILE* fp = fopen(filename, "r");
+  if (!fp) {
+    fprintf(stderr, "APEX_Error : Unable to open %s\n", filename);
+    return -1;
+  }
+
+  char* line = NULL;
+  size_t len = 0;
+  int line_num = 0;
+  int status = 0;
+
+  while (status == 0 && getline(&line, &len, fp) != -1) {
+    line_num++;
+    line[strcspn(line, "#")] = '\0';
+    if (line[strspn(line, " \t\r\n")] == '\0') {
+      continue;
+    }
+    if (!strchr(line, '=') || config_set_pair(config, line) != 0) {
+      fprintf(stderr, "APEX_Error : %s:%d: expected <key> = <value>\n",
+              filename, line_num);
+      status = -1;
+    }
+  }
+
+  free(line);
+  fclose(fp);
+  return status;
+}
+
+/*
+ * Applies "key=value" arguments. Returns the number of arguments
+ * consumed, or -1 on a bad one
+ */
+int
+apex_config_args(APEX_Config* config, int argc, char const* argv[])
+{
+  for (int i = 0; i < argc; ++i) {
+    char pair[256];
+    if (!strchr(argv[i], '=') || strlen(argv[i]) >= sizeof(pair)) {
+      return i;
+    }
+    strcpy(pair, argv[i]);
+    if (config_set_pair(config, pair) != 0) {
+      return -1;
+    }
+  }
+  return argc;
+}
+
+/*
+ * Checks every parameter is within range, for configs built by hand
+ */
+int
+apex_config_validate(const APEX_Config* config)
+{
+  for (size_t i = 0; i < NUM_CONFIG_KEYS; ++i) {
+    int v = *(const int*)((const char*)config + config_keys[i].offset);
+    if (v < config_keys[i].min || v > config_keys[i].max) {
+      fprintf(stderr, "APEX_Error : %s must be an integer in [%d, %d]\n",
+              config_keys[i].name, config_keys[i].min, config_keys[i].max);
+      return -1;
+    }
+  }
+  return 0;
+}
@@ -6,6 +6,7 @@
  *  
  *  State University of New York, Binghamton
  */
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,73 +15,417 @@
 
 /* Set this flag to 1 to enable debug messages */
 #define ENABLE_DEBUG_MESSAGES 1
-#define LSQ_SIZE 6
+
+/* Debug messages are printed only for instances running in display mode */
+#define DEBUG_MESSAGES(cpu) (ENABLE_DEBUG_MESSAGES && (cpu)->debug)
+
+const char *const apex_stall_names[NUM_STALLS] = {
+  [STALL_FRONTEND] = "frontend",
+  [STALL_PRF_FULL] = "prf_full",
+  [STALL_IQ_FULL] = "iq_full",
+  [STALL_LSQ_FULL] = "lsq_full",
+  [STALL_ROB_FULL] = "rob_full",
+  [STALL_BR_TAGS] = "br_tags",
+};
+
+static inline void
+bit_set(APEX_Bits *bits, int i)
+{
+  bits[i / APEX_BITS_PER_WORD] |= (APEX_Bits)1 << (i % APEX_BITS_PER_WORD);
+}
+
+static inline void
+bit_clear(APEX_Bits *bits, int i)
+{
+  bits[i / APEX_BITS_PER_WORD] &= ~((APEX_Bits)1 << (i % APEX_BITS_PER_WORD));
+}
+
+static inline int
+bit_test(const APEX_Bits *bits, int i)
+{
+  return (bits[i / APEX_BITS_PER_WORD] >> (i % APEX_BITS_PER_WORD)) & 1;
+}
+
+/*
+ * Returns the first set bit at or after 'from' in a bitset of 'words'
+ * words, or -1
+ */
+static int
+bits_next(const APEX_Bits *bits, int words, int from)
+{
+  int w = from / APEX_BITS_PER_WORD;
+  if (w >= words)
+  {
+    return -1;
+  }
+  APEX_Bits word = bits[w] & (~(APEX_Bits)0 << (from % APEX_BITS_PER_WORD));
+  while (!word)
+  {
+    if (++w >= words)
+    {
+      return -1;
+    }
+    word = bits[w];
+  }
+  return w * APEX_BITS_PER_WORD + __builtin_ctzll(word);
+}
+
+/*
+ * Returns the first clear bit below 'n', or -1 if all n are set
+ */
+static int
+bits_first_clear(const APEX_Bits *bits, int n)
+{
+  for (int w = 0; w < APEX_BITS_WORDS(n); ++w)
+  {
+    if (~bits[w])
+    {
+      int i = w * APEX_BITS_PER_WORD + __builtin_ctzll(~bits[w]);
+      return i < n ? i : -1;
+    }
+  }
+  return -1;
+}
+
+static int
+bits_any(const APEX_Bits *bits, int words)
+{
+  for (int w = 0; w < words; ++w)
+  {
+    if (bits[w])
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Returns 1 for the arithmetic instructions that set the zero flag */
+static int
+sets_zero_flag(int op)
+{
+  return op == OP_ADD || op == OP_SUB || op == OP_MUL || op == OP_ADDL ||
+         op == OP_SUBL;
+}
+
+static int
+is_store(int op)
+{
+  return op == OP_STORE || op == OP_STR;
+}
+
+static int
+is_branch(int op)
+{
+  return op == OP_BZ || op == OP_BNZ || op == OP_JUMP;
+}
+
+/*
+ * Index of the latch of slot 's' of front-end stage 'x'. Slot 0 of a
+ * stage holds the oldest instruction of its group
+ */
+static inline int
+front_latch(APEX_CPU *cpu, int x, int s)
+{
+  return x == F ? F : DRF + (x - DRF) * cpu->config.fetch_width + s;
+}
+
+/*
+ * Returns 1 if any slot of front-end stage 'x' holds an instruction
+ */
+static int
+front_occupied(APEX_CPU *cpu, int x)
+{
+  for (int s = 0; s < cpu->config.fetch_width; ++s)
+  {
+    if (!cpu->stage[front_latch(cpu, x, s)].busy)
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Returns 1 if any slot of front-end stage 'x' is stalled
+ */
+static int
+front_stalled(APEX_CPU *cpu, int x)
+{
+  for (int s = 0; s < cpu->config.fetch_width; ++s)
+  {
+    if (cpu->stage[front_latch(cpu, x, s)].stalled)
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Carves every bitset of the cpu out of one allocation, so that a
+ * checkpoint saves them as a single block
+ */
+static int
+create_bits(APEX_CPU *cpu)
+{
+  int branches = cpu->config.branch_tags;
+
+  cpu->tag_words = APEX_BITS_WORDS(cpu->num_tags);
+  cpu->iq_words = APEX_BITS_WORDS(cpu->config.iq_size);
+  cpu->lsq_words = APEX_BITS_WORDS(cpu->config.lsq_size);
+  cpu->bits_words = (2 + branches) * cpu->tag_words +
+                    (1 + NUM_FU_CLASSES) * cpu->iq_words +
+                    cpu->num_tags * cpu->iq_words + branches * cpu->iq_words +
+                    cpu->num_tags * cpu->lsq_words + branches * cpu->lsq_words;
+  cpu->bits = calloc(cpu->bits_words, sizeof(APEX_Bits));
+  if (!cpu->bits)
+  {
+    return -1;
+  }
+
+  APEX_Bits *p = cpu->bits;
+  cpu->reg_ready = p;
+  p += cpu->tag_words;
+  cpu->prf_free = p;
+  p += cpu->tag_words;
+  cpu->br_alloc = p;
+  p += branches * cpu->tag_words;
+  cpu->iq_used = p;
+  p += cpu->iq_words;
+  for (int fu = 0; fu < NUM_FU_CLASSES; ++fu)
+  {
+    cpu->iq_ready[fu] = p;
+    p += cpu->iq_words;
+  }
+  cpu->iq_waiters = p;
+  p += cpu->num_tags * cpu->iq_words;
+  cpu->iq_branch = p;
+  p += branches * cpu->iq_words;
+  cpu->lsq_waiters = p;
+  p += cpu->num_tags * cpu->lsq_words;
+  cpu->lsq_branch = p;
+  return 0;
+}
+
+/* A class of functional units, sized by the config. MEM units take loads
+ * from the LSQ; the other units issue IQ entries of the classes they
+ * accept (see issue_class())
+ */
+typedef struct APEX_UnitClass
+{
+  const char *name; // Stage name in display mode
+  size_t count;     // Offsets of the parameters in APEX_Config
+  size_t latency;
+  size_t pipelined;
+  int accepts;      // Bitmask of (1 << FU_*) instruction classes executed
+} APEX_UnitClass;
+
+static const APEX_UnitClass unit_classes[NUM_FU_CLASSES] = {
+  [FU_INT] = { "Int", offsetof(APEX_Config, int_units),
+               offsetof(APEX_Config, int_latency),
+               offsetof(APEX_Config, int_pipelined), 1 << FU_INT },
+  [FU_MUL] = { "MUL", offsetof(APEX_Config, mul_units),
+               offsetof(APEX_Config, mul_latency),
+               offsetof(APEX_Config, mul_pipelined), 1 << FU_MUL },
+  [FU_MEM] = { "Memory", offsetof(APEX_Config, mem_units),
+               offsetof(APEX_Config, mem_latency),
+               offsetof(APEX_Config, mem_pipelined), 1 << FU_MEM },
+};
+
+static int
+config_int(const APEX_Config *config, size_t offset)
+{
+  return *(const int *)((const char *)config + offset);
+}
+
+/*
+ * Lays out the stage latches: the front-end stages, then for every unit
+ * its stages followed by its retire latch. Units are ordered INT, MUL, MEM,
+ * which is also their priority at retirement
+ */
+static int
+create_units(APEX_CPU *cpu)
+{
+  cpu->num_units = 0;
+  for (int fu = FU_INT; fu < NUM_FU_CLASSES; ++fu)
+  {
+    cpu->num_units += config_int(&cpu->config, unit_classes[fu].count);
+  }
+  cpu->units = calloc(cpu->num_units, sizeof(*cpu->units));
+  if (!cpu->units)
+  {
+    return -1;
+  }
+
+  int stage = front_latch(cpu, NUM_FRONT_STAGES, 0);
+  int u = 0;
+  for (int fu = FU_INT; fu < NUM_FU_CLASSES; ++fu)
+  {
+    const APEX_UnitClass *cls = &unit_classes[fu];
+    int count = config_int(&cpu->config, cls->count);
+    int latency = config_int(&cpu->config, cls->latency);
+    for (int n = 0; n < count; ++n, ++u)
+    {
+      cpu->units[u].fu = fu;
+      cpu->units[u].number = n + 1;
+      cpu->units[u].first_stage = stage;
+      cpu->units[u].latency = latency;
+      cpu->units[u].ret_stage = stage + latency;
+      cpu->units[u].pipelined = config_int(&cpu->config, cls->pipelined);
+      cpu->units[u].accepts = cls->accepts;
+      stage += latency + 1;
+    }
+  }
+  cpu->num_stages = stage;
+  return 0;
+}
 
 /*
- * This function creates and initializes APEX cpu.
+ * This function creates and initializes APEX cpu around code memory owned
+ * by the caller, which may be shared read-only by many instances. A NULL
+ * config selects the default datapath.
  *
  * Note : You are free to edit this function according to your
  * 				implementation
  */
 APEX_CPU *
-APEX_cpu_init(const char *filename)
+APEX_cpu_create(APEX_Instruction *code_memory, int code_memory_size,
+                const APEX_Config *config)
 {
-  if (!filename)
+  if (!code_memory)
   {
     return NULL;
   }
 
-  APEX_CPU *cpu = malloc(sizeof(*cpu));
+  APEX_CPU *cpu = calloc(1, sizeof(*cpu));
   if (!cpu)
   {
     return NULL;
   }
 
-  /* Initialize PC, Registers and all pipeline stages */
-  cpu->pc = 4000;
-  //memset(cpu->regs, 0, sizeof(int) * 32);
-  //memset(cpu->regs_valid, 1, sizeof(int) * 32);
-  memset(cpu->stage, 0, sizeof(CPU_Stage) * NUM_STAGES);
-  memset(cpu->data_memory, 0, sizeof(int) * 4000);
-
-  /* Parse input file and create code memory */
-  cpu->code_memory = create_code_memory(filename, &cpu->code_memory_size);
-
-  if (!cpu->code_memory)
+  if (config)
+  {
+    cpu->config = *config;
+  }
+  else
+  {
+    apex_config_default(&cpu->config);
+  }
+  cpu->num_tags = cpu->config.prf_size;
+  if (apex_config_validate(&cpu->config) != 0 || create_units(cpu) != 0 ||
+      create_bits(cpu) != 0)
   {
-    free(cpu);
+    APEX_cpu_stop(cpu);
     return NULL;
   }
 
-  if (ENABLE_DEBUG_MESSAGES)
+  cpu->latches = calloc(2 * cpu->num_stages, sizeof(CPU_Stage));
+  cpu->IQ = calloc(cpu->config.iq_size, sizeof(iq));
+  cpu->LSQ = calloc(cpu->config.lsq_size, sizeof(lsq));
+  cpu->ROB = calloc(cpu->config.rob_size, sizeof(rob));
+  cpu->prf = calloc(cpu->config.prf_size, sizeof(int));
+  if (!cpu->latches || !cpu->IQ || !cpu->LSQ || !cpu->ROB || !cpu->prf ||
+      apex_memory_create(cpu) != 0)
   {
-    fprintf(stderr,
-            "APEX_CPU : Initialized APEX CPU, loaded %d instructions\n",
-            cpu->code_memory_size);
-    fprintf(stderr, "APEX_CPU : Printing Code Memory\n");
-    printf("%-9s %-9s %-9s %-9s %-9s\n", "opcode", "rd", "rs1", "rs2", "rs3", "imm");
+    APEX_cpu_stop(cpu);
+    return NULL;
+  }
 
-    for (int i = 0; i < cpu->code_memory_size; ++i)
-    {
-      printf("%-9s %-9d %-9d %-9d %-9d %-9d \n",
-             cpu->code_memory[i].opcode,
-             cpu->code_memory[i].rd,
-             cpu->code_memory[i].rs1,
-             cpu->code_memory[i].rs2,
-             cpu->code_memory[i].rs3,
-             cpu->code_memory[i].imm);
-    }
+  /* Initialize PC, Registers and all pipeline stages. Architectural
+   * register i starts in physical register i, and the rest are free
+   */
+  cpu->pc = 4000;
+  memset(cpu->regs, 0, sizeof(cpu->regs));
+  for (int i = 0; i < cpu->num_tags; ++i)
+  {
+    bit_set(cpu->reg_ready, i);
+  }
+  for (int i = 0; i < NUM_ARCH_REGS; ++i)
+  {
+    cpu->rename_table[i] = i;
+    cpu->arch_map[i] = i;
+  }
+  for (int i = NUM_ARCH_REGS; i < cpu->config.prf_size; ++i)
+  {
+    bit_set(cpu->prf_free, i);
+    cpu->free_count++;
+  }
+  cpu->stage = cpu->latches;
+  cpu->next = cpu->latches + cpu->num_stages;
+
+  cpu->code_memory = code_memory;
+  cpu->code_memory_size = code_memory_size;
+  cpu->z_rob = -1;
+  if (apex_bpred_create(cpu) != 0 || apex_cache_create(cpu) != 0 ||
+      apex_prefetch_create(cpu) != 0)
+  {
+    APEX_cpu_stop(cpu);
+    return NULL;
   }
 
   /* Make all stages busy except Fetch stage, initally to start the pipeline */
-  for (int i = 1; i < NUM_STAGES; ++i)
+  for (int i = 1; i < cpu->num_stages; ++i)
   {
     cpu->stage[i].busy = 1;
   }
+  for (int i = 0; i < cpu->num_stages; ++i)
+  {
+    cpu->next[i].busy = 1;
+  }
+
+  return cpu;
+}
+
+/*
+ * This function loads a program and creates an APEX cpu that owns its
+ * code memory.
+ */
+APEX_CPU *
+APEX_cpu_init(const char *filename, const APEX_Config *config)
+{
+  int size = 0;
+  void *mapping = NULL;
+  size_t mapping_size = 0;
+  APEX_Instruction *code_memory =
+      load_code_memory(filename, &size, &mapping, &mapping_size);
 
+  APEX_CPU *cpu = APEX_cpu_create(code_memory, size, config);
+  if (!cpu)
+  {
+    free_code_memory(code_memory, mapping, mapping_size);
+    return NULL;
+  }
+  cpu->owns_code = 1;
+  cpu->code_mapping = mapping;
+  cpu->code_mapping_size = mapping_size;
   return cpu;
 }
 
+/*
+ * Debug function which dumps the code memory
+ */
+static void
+print_code_memory(APEX_CPU *cpu)
+{
+  fprintf(stderr,
+          "APEX_CPU : Initialized APEX CPU, loaded %d instructions\n",
+          cpu->code_memory_size);
+  fprintf(stderr, "APEX_CPU : Printing Code Memory\n");
+  printf("%-9s %-9s %-9s %-9s %-9s %-9s\n", "opcode", "rd", "rs1", "rs2", "rs3", "imm");
+
+  for (int i = 0; i < cpu->code_memory_size; ++i)
+  {
+    printf("%-9s %-9d %-9d %-9d %-9d %-9d \n",
+           apex_op_info[cpu->code_memory[i].op].name,
+           cpu->code_memory[i].rd,
+           cpu->code_memory[i].rs1,
+           cpu->code_memory[i].rs2,
+           cpu->code_memory[i].rs3,
+           cpu->code_memory[i].imm);
+  }
+}
+
 /*
  * This function de-allocates APEX cpu.
  *
@@ -89,7 +434,22 @@ APEX_cpu_init(const char *filename)
  */
 void APEX_cpu_stop(APEX_CPU *cpu)
 {
-  free(cpu->code_memory);
+  if (cpu->owns_code)
+  {
+    free_code_memory(cpu->code_memory, cpu->code_mapping,
+                     cpu->code_mapping_size);
+  }
+  apex_bpred_free(cpu);
+  apex_cache_free(cpu);
+  apex_prefetch_free(cpu);
+  free(cpu->units);
+  free(cpu->bits);
+  free(cpu->latches);
+  free(cpu->IQ);
+  free(cpu->LSQ);
+  free(cpu->ROB);
+  free(cpu->prf);
+  apex_memory_free(cpu);
   free(cpu);
 }
 
@@ -104,64 +464,44 @@ int get_code_index(int pc)
   return (pc - 4000) / 4;
 }
 
+/* Prints an instruction in its assembly form, driven by the operand
+ * format of its opcode
+ */
 static void
-print_instruction(CPU_Stage *stage)
+print_fields(int op, int rd, int rs1, int rs2, int rs3, int imm)
 {
-  if (strcmp(stage->opcode, "STORE") == 0)
-  {
-    printf("%s,R%d,R%d,#%d ", stage->opcode, stage->rs1, stage->rs2, stage->imm);
-  }
-  if (strcmp(stage->opcode, "LOAD") == 0)
-  {
-    printf("%s,R%d,R%d,#%d ", stage->opcode, stage->rd, stage->rs1, stage->imm);
-  }
-
-  if (strcmp(stage->opcode, "STR") == 0)
-  {
-    printf("%s,R%d,R%d,#%d ", stage->opcode, stage->rs1, stage->rs2, stage->rs3);
-  }
-
-  if (strcmp(stage->opcode, "ADDL") == 0 ||
-      strcmp(stage->opcode, "SUBL") == 0)
-  {
-    printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->imm);
-  }
-
-  if (strcmp(stage->opcode, "ADD") == 0 ||
-      strcmp(stage->opcode, "SUB") == 0 ||
-      strcmp(stage->opcode, "AND") == 0 ||
-      strcmp(stage->opcode, "OR") == 0 ||
-      strcmp(stage->opcode, "EX-OR") == 0 ||
-      strcmp(stage->opcode, "MUL") == 0 ||
-      strcmp(stage->opcode, "LDR") == 0)
-  {
-
-    printf("%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->rs2);
-  }
-
-  if (strcmp(stage->opcode, "MOVC") == 0)
-  {
-    printf("%s,R%d,#%d ", stage->opcode, stage->rd, stage->imm);
-  }
-  if (strcmp(stage->opcode, "BZ") == 0 ||
-      strcmp(stage->opcode, "BNZ") == 0)
-  {
-    printf("%s,#%d ", stage->opcode, stage->imm);
-  }
-  if (strcmp(stage->opcode, "JUMP") == 0)
-  {
-    printf("%s,R%d,#%d ", stage->opcode, stage->rs1, stage->imm);
-  }
+  const APEX_Format *fmt = &apex_formats[apex_op_info[op].format];
 
-  if (strcmp(stage->opcode, "HALT") == 0)
+  printf("%s", apex_op_info[op].name);
+  for (int i = 0; i < fmt->num_operands; ++i)
   {
-    printf("%s", stage->opcode);
+    switch (fmt->operands[i])
+    {
+    case OPND_RD:
+      printf(",R%d", rd);
+      break;
+    case OPND_RS1:
+      printf(",R%d", rs1);
+      break;
+    case OPND_RS2:
+      printf(",R%d", rs2);
+      break;
+    case OPND_RS3:
+      printf(",R%d", rs3);
+      break;
+    case OPND_IMM:
+      printf(",#%d", imm);
+      break;
+    }
   }
+  printf(" ");
+}
 
-  if (strcmp(stage->opcode, "EMPTY") == 0)
-  {
-    printf("%s", stage->opcode);
-  }
+static void
+print_instruction(CPU_Stage *stage)
+{
+  print_fields(stage->op, stage->rd, stage->rs1, stage->rs2, stage->rs3,
+               stage->imm);
 }
 
 /* Debug function which dumps the cpu stage
@@ -187,42 +527,62 @@ print_stage_content(char *name, CPU_Stage *stage)
 int fetch(APEX_CPU *cpu)
 {
   CPU_Stage *stage = &cpu->stage[F];
-  if (!stage->busy && !stage->stalled) //&& !cpu->haltflag)
+  if (!stage->busy && !stage->stalled)
   {
-    /* Store current PC in fetch latch */
-    stage->pc = cpu->pc;
-    /* Index into code memory using this pc and copy all instruction fields into
-     * fetch latch
-     */
-    APEX_Instruction *current_ins = &cpu->code_memory[get_code_index(cpu->pc)];
-    strcpy(stage->opcode, current_ins->opcode);
-    stage->rd = current_ins->rd;
-    stage->rs1 = current_ins->rs1;
-    stage->rs2 = current_ins->rs2;
-    stage->imm = current_ins->imm;
-    stage->rd = current_ins->rd;
-
-    /* Update PC for next instruction */
-    cpu->pc += 4;
-
-    /* Copy data from fetch latch to decode latch*/
-    //if (!cpu->stage[DRF].stalled)
-    //{
-    /*if (strcmp(cpu->stage[DRF].opcode, "HALT") != 0)
-      {
-        cpu->stage[DRF] = cpu->stage[F];
-      }*/
+    /* Keep the fetch unit running in the next cycle */
+    cpu->next[F] = *stage;
 
-    //}
-    //else
-    ///{
-    //  stage->stalled = 1;
-    //}
-    cpu->stage[DRF] = cpu->stage[F];
+    /* The fetch group waits while any of decode is stalled, and nothing
+     * new enters the pipeline while it drains
+     */
+    if (front_stalled(cpu, DRF) || cpu->draining)
+    {
+      return 0;
+    }
 
-    if (ENABLE_DEBUG_MESSAGES)
+    /* Fetch up to fetch_width consecutive instructions into the decode
+     * slots of the next cycle. The group ends at the end of code memory
+     * and after a branch predicted taken
+     */
+    for (int s = 0; s < cpu->config.fetch_width; ++s)
     {
-      print_stage_content("Fetch", stage);
+      int index = get_code_index(cpu->pc);
+      if (index < 0 || index >= cpu->code_memory_size)
+      {
+        break;
+      }
+
+      /* Index into code memory using this pc and copy all instruction
+       * fields straight into the decode latch
+       */
+      CPU_Stage *out = &cpu->next[front_latch(cpu, DRF, s)];
+      APEX_Instruction *current_ins = &cpu->code_memory[index];
+      out->pc = cpu->pc;
+      out->op = current_ins->op;
+      out->rd = current_ins->rd;
+      out->rs1 = current_ins->rs1;
+      out->rs2 = current_ins->rs2;
+      out->rs3 = current_ins->rs3;
+      out->imm = current_ins->imm;
+      out->busy = 0;
+      out->stalled = 0;
+
+      /* Update PC for next instruction, as predicted for branches */
+      int shifted;
+      out->ghr = cpu->ghr;
+      out->pred_pc =
+          apex_bpred_predict(cpu, cpu->pc, current_ins->op, &shifted);
+      out->ghr_shifted = shifted;
+      cpu->pc = out->pred_pc;
+
+      if (DEBUG_MESSAGES(cpu))
+      {
+        print_stage_content("Fetch", out);
+      }
+      if (out->pred_pc != out->pc + 4)
+      {
+        break;
+      }
     }
   }
   return 0;
@@ -236,801 +596,2042 @@ int fetch(APEX_CPU *cpu)
  */
 int decode(APEX_CPU *cpu)
 {
-  CPU_Stage *stage = &cpu->stage[DRF];
-  if (!stage->busy && !stage->stalled)
+  /* The slots of the group are renamed and dispatched in program order, so
+   * a later slot sees the destinations renamed by the earlier ones. A
+   * stalled slot holds every slot after it (see update_stalls)
+   */
+  for (int s = 0; s < cpu->config.fetch_width; ++s)
   {
-    if (strcmp(stage->opcode, "HALT") == 0)
+    CPU_Stage *stage = &cpu->stage[front_latch(cpu, DRF, s)];
+    if (stage->busy || stage->stalled)
+    {
+      continue;
+    }
+
+    const APEX_Format *fmt = &apex_formats[apex_op_info[stage->op].format];
+    CPU_Stage *out = &cpu->next[front_latch(cpu, ROB, s)];
+
+    *out = *stage;
+    if (stage->op == OP_HALT && DEBUG_MESSAGES(cpu))
     {
-      cpu->stage[ROB] = cpu->stage[DRF];
       printf("AT DECODE HALT----");
-      //cpu->ins_completed++;
     }
-    if (strcmp(stage->opcode, "STORE") == 0)
+
+    /* Rename: the sources named by the operand format read the physical
+     * registers they are mapped to, and those that hold their value are
+     * read now; the others are marked pending and captured from the
+     * result broadcast. The destination is then given a free physical
+     * register, which waits for this instruction's result
+     */
+    out->pending = 0;
+    out->br_mask = cpu->br_active;
+    if (fmt->reads & (1 << OPND_RS1))
     {
-      if (cpu->regs_valid[stage->rs1] && cpu->regs_valid[stage->rs2])
+      out->prs1 = cpu->rename_table[stage->rs1];
+      if (bit_test(cpu->reg_ready, out->prs1))
       {
-        stage->stalled = 0;
-        stage->rs1_value = cpu->regs[stage->rs1];
-        stage->rs2_value = cpu->regs[stage->rs2];
+        out->rs1_value = cpu->prf[out->prs1];
       }
       else
       {
-        stage->stalled = 0;
+        out->pending |= 1 << OPND_RS1;
       }
     }
-
-    /* STR */
-    if (strcmp(stage->opcode, "STR") == 0)
+    if (fmt->reads & (1 << OPND_RS2))
     {
-      if (cpu->regs_valid[stage->rs1] && cpu->regs_valid[stage->rs2] && cpu->regs_valid[stage->rs3])
+      out->prs2 = cpu->rename_table[stage->rs2];
+      if (bit_test(cpu->reg_ready, out->prs2))
       {
-        stage->stalled = 0;
-        stage->rs1_value = cpu->regs[stage->rs1];
-        stage->rs2_value = cpu->regs[stage->rs2];
-        stage->rs3_value = cpu->regs[stage->rs3];
+        out->rs2_value = cpu->prf[out->prs2];
       }
       else
       {
-        stage->stalled = 0;
+        out->pending |= 1 << OPND_RS2;
       }
     }
-
-    /* LOAD */
-    if (strcmp(stage->opcode, "LOAD") == 0)
+    if (fmt->reads & (1 << OPND_RS3))
     {
-      if (cpu->regs_valid[stage->rs1])
+      out->prs3 = cpu->rename_table[stage->rs3];
+      if (bit_test(cpu->reg_ready, out->prs3))
       {
-        stage->stalled = 0;
-        stage->rs1_value = cpu->regs[stage->rs1];
-        cpu->regs_valid[stage->rd] = 0; //making register invalid
+        out->rs3_value = cpu->prf[out->prs3];
       }
       else
       {
-        stage->stalled = 0;
+        out->pending |= 1 << OPND_RS3;
       }
     }
-
-    /* LDR */
-    if (strcmp(stage->opcode, "LDR") == 0)
+    /* BZ and BNZ test the zero flag through the result of the youngest
+     * instruction before them that sets it, read like a source
+     */
+    if (stage->op == OP_BZ || stage->op == OP_BNZ)
     {
-      if (cpu->regs_valid[stage->rs1] && cpu->regs_valid[stage->rs2])
+      if (cpu->z_rob < 0)
       {
-        stage->stalled = 0;
-        stage->rs1_value = cpu->regs[stage->rs1];
-        stage->rs1_value = cpu->regs[stage->rs2];
-        cpu->regs_valid[stage->rd] = 0;
+        out->rs1_value = !cpu->z_flag;
       }
       else
       {
-        stage->stalled = 0;
+        out->prs1 = cpu->ROB[cpu->z_rob].prd;
+        if (bit_test(cpu->reg_ready, out->prs1))
+        {
+          out->rs1_value = cpu->prf[out->prs1];
+        }
+        else
+        {
+          out->pending |= 1 << OPND_RS1;
+        }
       }
     }
-
-    /* No Register file read needed for MOVC */
-    if (strcmp(stage->opcode, "MOVC") == 0)
+    int prev_prd = 0;
+    if (fmt->writes_rd)
     {
-      cpu->regs_valid[stage->rd] = 0;
+      prev_prd = cpu->rename_table[stage->rd];
+      out->prd = get_PR(cpu);
+      cpu->rename_table[stage->rd] = out->prd;
+      bit_clear(cpu->reg_ready, out->prd);
     }
 
-    /* ADD, SUB , MUL*/
-    if (strcmp(stage->opcode, "ADD") == 0 ||
-        strcmp(stage->opcode, "SUB") == 0 ||
-        strcmp(stage->opcode, "MUL") == 0 ||
-        strcmp(stage->opcode, "ADDL") == 0 ||
-        strcmp(stage->opcode, "SUBL") == 0)
+    /* Dispatch the decoded instruction to the tail of the ROB and to the
+     * IQ, and to the tail of the LSQ for memory instructions. HALT only
+     * takes a ROB entry
+     */
+    out->rob = get_ROB(cpu, out);
+    cpu->ROB[out->rob].prev_prd = prev_prd;
+    if (sets_zero_flag(stage->op))
     {
-      //cpu->z_flag_set = 0;
-      if (cpu->regs_valid[stage->rs1] && cpu->regs_valid[stage->rs2])
-      {
-        stage->rs1_value = cpu->regs[stage->rs1];
-        stage->rs2_value = cpu->regs[stage->rs2];
-        cpu->regs_valid[stage->rd] = 0;
-        //cpu->z_flag_set = 0;
-      }
-      else
-      {
-        stage->stalled = 0;
-      }
+      cpu->z_rob = out->rob;
     }
-
-    /* AND,OR,EX-OR */
-    if (strcmp(stage->opcode, "AND") == 0 ||
-        strcmp(stage->opcode, "OR") == 0 ||
-        strcmp(stage->opcode, "EX-OR") == 0)
+    if (is_branch(stage->op))
     {
-      if (cpu->regs_valid[stage->rs1] && cpu->regs_valid[stage->rs2])
-      {
-        stage->stalled = 0;
-        stage->rs1_value = cpu->regs[stage->rs1];
-        stage->rs2_value = cpu->regs[stage->rs2];
-        cpu->regs_valid[stage->rd] = 0;
-      }
-      else
-      {
-        stage->stalled = 0;
-      }
+      out->br_tag = get_BT(cpu, out);
     }
-
-    /* JUMP */
-    if (strcmp(stage->opcode, "JUMP") == 0)
+    if (apex_op_info[stage->op].fu == FU_MEM)
     {
-      if (cpu->regs_valid[stage->rs1])
-      {
-        stage->stalled = 0;
-        stage->rs1_value = cpu->regs[stage->rs1];
-      }
-      else
-      {
-        stage->stalled = 0;
-      }
+      out->lsq = get_LSQ(cpu, out);
+      cpu->next[front_latch(cpu, LSQ, s)] = *out;
     }
 
-    // LSQ Condition
-    if (strcmp(stage->opcode, "LOAD") == 0 ||
-        strcmp(stage->opcode, "STR") == 0 ||
-        strcmp(stage->opcode, "LDR") == 0 ||
-        strcmp(stage->opcode, "STORE") == 0)
+    /* A store's data goes straight to its LSQ entry, so the store issues
+     * as soon as its address can be computed
+     */
+    if (is_store(stage->op))
     {
-      cpu->stage[LSQ] = cpu->stage[DRF];
-      cpu->stage[IQ] = cpu->stage[DRF];
+      out->pending &= ~(1 << OPND_RS1);
+    }
+    if (stage->op != OP_HALT)
+    {
+      cpu->next[front_latch(cpu, IQ, s)] = *out;
     }
 
-    /* Copy data from decode latch to execute latch*/
-    cpu->stage[IQ] = cpu->stage[DRF];
-    cpu->stage[ROB] = cpu->stage[DRF];
-
-    if (ENABLE_DEBUG_MESSAGES)
+    if (DEBUG_MESSAGES(cpu))
     {
       print_stage_content("Decode/RF", stage);
     }
   }
   return 0;
 }
-/*
- *  Memory FU Stage of APEX Pipeline
- *
- *  Note : You are free to edit this function according to your
- * 				 implementation
- */
-int fetch_IQ(APEX_CPU *cpu)
+
+/* Operation performed by a functional unit stage on its latch */
+typedef void (*APEX_ExecFn)(APEX_CPU *cpu, CPU_Stage *stage);
+
+static void
+exec_add(APEX_CPU *cpu, CPU_Stage *stage)
 {
-  for (int i = 0; i <= 7; i++)
-  {
-    if (cpu->IQ[i].get_data == 0)
-    {
-      return i;
-    }
-  }
+  stage->buffer = stage->rs1_value + stage->rs2_value;
 }
 
-int fetch_LSQ(APEX_CPU *cpu)
+static void
+exec_sub(APEX_CPU *cpu, CPU_Stage *stage)
 {
-  for (int i = 0; i <= 5; i++)
-  {
-    if (cpu->LSQ[i].get_data == 0)
-    {
-      return i;
-    }
-  }
+  stage->buffer = stage->rs1_value - stage->rs2_value;
 }
 
-int fetch_ROB(APEX_CPU *cpu)
+static void
+exec_mul(APEX_CPU *cpu, CPU_Stage *stage)
 {
-  for (int i = 0; i <= 12; i++)
-  {
-    if (cpu->ROB[i].get_data == 0)
-    {
-      return i;
-    }
-  }
+  stage->buffer = stage->rs1_value * stage->rs2_value;
 }
 
-int get_I(APEX_CPU *cpu)
+static void
+exec_and(APEX_CPU *cpu, CPU_Stage *stage)
 {
-  CPU_Stage *stage = &cpu->stage[IQ];
+  stage->buffer = stage->rs1_value & stage->rs2_value;
+}
 
-  int getIQ = fetch_IQ(cpu);
-  if (IQ_Squash(cpu, stage->pc) == 1)
-  {
+static void
+exec_or(APEX_CPU *cpu, CPU_Stage *stage)
+{
+  stage->buffer = stage->rs1_value | stage->rs2_value;
+}
 
-    cpu->IQ[getIQ].pc = stage->pc;
-    // printf("\n \n%d -------- %d",cpu->IQ[getIQ].pc, stage->pc);
+static void
+exec_exor(APEX_CPU *cpu, CPU_Stage *stage)
+{
+  stage->buffer = stage->rs1_value ^ stage->rs2_value;
+}
 
-    strcpy(cpu->IQ[getIQ].opcode, stage->opcode);
-    cpu->IQ[getIQ].rd = stage->rd;
-    cpu->IQ[getIQ].rs1 = stage->rs1;
-    cpu->IQ[getIQ].rs2 = stage->rs2;
-    cpu->IQ[getIQ].get_data = 1;
-  }
+static void
+exec_addl(APEX_CPU *cpu, CPU_Stage *stage)
+{
+  stage->buffer = stage->rs1_value + stage->imm;
 }
 
-int get_LSQ(APEX_CPU *cpu)
+static void
+exec_subl(APEX_CPU *cpu, CPU_Stage *stage)
 {
-  CPU_Stage *stage = &cpu->stage[LSQ];
+  stage->buffer = stage->rs1_value - stage->imm;
+}
 
-  int getLSQ = fetch_LSQ(cpu);
-  if (LSQ_Squash(cpu, stage->pc) == 1)
+static void
+exec_movc(APEX_CPU *cpu, CPU_Stage *stage)
+{
+  stage->buffer = stage->imm + 0;
+}
+
+/* Branch resolution: the pc that follows the branch. BZ and BNZ find
+ * the value that set the zero flag in rs1_value
+ */
+static void
+exec_bz(APEX_CPU *cpu, CPU_Stage *stage)
+{
+  stage->buffer =
+      stage->rs1_value == 0 ? stage->pc + stage->imm : stage->pc + 4;
+}
+
+static void
+exec_bnz(APEX_CPU *cpu, CPU_Stage *stage)
+{
+  stage->buffer =
+      stage->rs1_value != 0 ? stage->pc + stage->imm : stage->pc + 4;
+}
+
+static void
+exec_jump(APEX_CPU *cpu, CPU_Stage *stage)
+{
+  stage->buffer = stage->rs1_value + stage->imm;
+}
+
+/* Memory address calculation */
+static void
+exec_store_addr(APEX_CPU *cpu, CPU_Stage *stage)
+{
+  stage->mem_address = stage->rs2_value + stage->imm;
+}
+
+static void
+exec_load_addr(APEX_CPU *cpu, CPU_Stage *stage)
+{
+  stage->mem_address = stage->rs1_value + stage->imm;
+}
+
+static void
+exec_ldr_addr(APEX_CPU *cpu, CPU_Stage *stage)
+{
+  stage->mem_address = stage->rs1_value + stage->rs2_value;
+}
+
+static void
+exec_str_addr(APEX_CPU *cpu, CPU_Stage *stage)
+{
+  stage->mem_address = stage->rs2_value + stage->rs3_value;
+}
+
+/* Memory read of a load whose address was computed by an INT unit; a
+ * value forwarded from an older store is kept
+ */
+static void
+exec_load(APEX_CPU *cpu, CPU_Stage *stage)
+{
+  if (!stage->forwarded && stage->mem_address >= 0 &&
+      stage->mem_address < cpu->config.data_memory_size)
   {
+    stage->buffer = apex_memory_read(cpu, stage->mem_address);
+  }
+}
+
+/* Jump tables, indexed by the decoded opcode of the latch */
+static const APEX_ExecFn int_ops[NUM_OPCODES] = {
+  [OP_ADD] = exec_add,
+  [OP_SUB] = exec_sub,
+  [OP_AND] = exec_and,
+  [OP_OR] = exec_or,
+  [OP_EXOR] = exec_exor,
+  [OP_ADDL] = exec_addl,
+  [OP_SUBL] = exec_subl,
+  [OP_MOVC] = exec_movc,
+  [OP_LOAD] = exec_load_addr,
+  [OP_LDR] = exec_ldr_addr,
+  [OP_STORE] = exec_store_addr,
+  [OP_STR] = exec_str_addr,
+  [OP_BZ] = exec_bz,
+  [OP_BNZ] = exec_bnz,
+  [OP_JUMP] = exec_jump,
+};
+
+static const APEX_ExecFn mul_ops[NUM_OPCODES] = {
+  [OP_MUL] = exec_mul,
+};
+
+static const APEX_ExecFn mem_ops[NUM_OPCODES] = {
+  [OP_LOAD] = exec_load,
+  [OP_LDR] = exec_load,
+};
+
+static const APEX_ExecFn *const fu_ops[NUM_FU_CLASSES] = {
+  [FU_INT] = int_ops,
+  [FU_MUL] = mul_ops,
+  [FU_MEM] = mem_ops,
+};
+
+/* Unit class an IQ entry issues to: memory instructions compute their
+ * address on an INT unit, and so do branches and HALT
+ */
+static int
+issue_class(int op)
+{
+  return apex_op_info[op].fu == FU_MUL ? FU_MUL : FU_INT;
+}
+
+/*
+ *  Queue allocation: the first free entry of the occupancy bitset, or -1
+ *  when the queue is full
+ *
+ *  Note : You are free to edit this function according to your
+ * 				 implementation
+ */
+int fetch_IQ(APEX_CPU *cpu)
+{
+  return bits_first_clear(cpu->iq_used, cpu->config.iq_size);
+}
 
-    cpu->LSQ[getLSQ].pc = stage->pc;
-    // printf("\n \n%d -------- %d",cpu->IQ[getIQ].pc, stage->pc);
+int fetch_LSQ(APEX_CPU *cpu)
+{
+  return cpu->lsq_count < cpu->config.lsq_size ? cpu->lsq_tail : -1;
+}
 
-    strcpy(cpu->LSQ[getLSQ].opcode, stage->opcode);
+int fetch_ROB(APEX_CPU *cpu)
+{
+  return cpu->rob_count < cpu->config.rob_size ? cpu->rob_tail : -1;
+}
 
-    cpu->IQ[getLSQ].rd = stage->rd;
-    cpu->IQ[getLSQ].rs1 = stage->rs1;
-    cpu->IQ[getLSQ].rs2 = stage->rs2;
-    cpu->IQ[getLSQ].get_data = 1;
+/*
+ * Takes a free physical register. It is recorded against every branch in
+ * flight, to be freed again if one of them mispredicts
+ *
+ * Note : update_stalls() holds decode while no register is free
+ */
+int get_PR(APEX_CPU *cpu)
+{
+  int pr = bits_next(cpu->prf_free, cpu->tag_words, 0);
+
+  bit_clear(cpu->prf_free, pr);
+  cpu->free_count--;
+  for (uint32_t m = cpu->br_active; m; m &= m - 1)
+  {
+    bit_set(&cpu->br_alloc[__builtin_ctz(m) * cpu->tag_words], pr);
   }
+  return pr;
 }
 
-int get_ROB(APEX_CPU *cpu)
+void free_PR(APEX_CPU *cpu, int pr)
 {
-  CPU_Stage *stage = &cpu->stage[ROB];
+  bit_set(cpu->prf_free, pr);
+  cpu->free_count++;
+}
 
-  int getROB = fetch_ROB(cpu);
+/*
+ * Gives a dispatched branch a free tag and snapshots the rename state
+ * behind it. Younger instructions carry the tag in their branch mask
+ *
+ * Note : update_stalls() holds decode while every tag is in use
+ */
+int get_BT(APEX_CPU *cpu, CPU_Stage *stage)
+{
+  int tag = __builtin_ctz(~cpu->br_active);
+  APEX_Snapshot *snap = &cpu->snapshots[tag];
+
+  memcpy(snap->rename_table, cpu->rename_table, sizeof(cpu->rename_table));
+  snap->br_mask = stage->br_mask;
+  snap->z_rob = cpu->z_rob;
+  snap->ghr_shifted = stage->ghr_shifted;
+  memset(&cpu->br_alloc[tag * cpu->tag_words], 0,
+         cpu->tag_words * sizeof(APEX_Bits));
+  cpu->br_active |= 1u << tag;
+  return tag;
+}
 
-  cpu->ROB[getROB].pc = stage->pc;
-  // printf("\n \n%d -------- %d",cpu->IQ[getIQ].pc, stage->pc);
+/*
+ * Inserts the dispatched instruction in IQ latch 'stage' into a free IQ
+ * entry. Sources still pending subscribe to the tag of their physical
+ * register; an entry without any is ready to issue at once
+ *
+ * Note : update_stalls() holds the IQ latch while the queue is full
+ */
+int get_I(APEX_CPU *cpu, CPU_Stage *stage)
+{
+  int getIQ = fetch_IQ(cpu);
+  if (getIQ < 0)
+  {
+    return 0;
+  }
 
-  strcpy(cpu->ROB[getROB].opcode, stage->opcode);
-  if (strcmp(cpu->ROB[getROB].opcode, "HALT") == 0)
+  iq *entry = &cpu->IQ[getIQ];
+  entry->pc = stage->pc;
+  entry->pred_pc = stage->pred_pc;
+  entry->ghr = stage->ghr;
+  entry->imm = stage->imm;
+  entry->op = stage->op;
+  entry->rd = stage->rd;
+  entry->rs1 = stage->rs1;
+  entry->rs2 = stage->rs2;
+  entry->rs3 = stage->rs3;
+  entry->rs1_value = stage->rs1_value;
+  entry->rs2_value = stage->rs2_value;
+  entry->rs3_value = stage->rs3_value;
+  entry->pending = stage->pending;
+  entry->prd = stage->prd;
+  entry->prs1 = stage->prs1;
+  entry->prs2 = stage->prs2;
+  entry->prs3 = stage->prs3;
+  entry->rob = stage->rob;
+  entry->lsq = stage->lsq;
+  entry->br_tag = stage->br_tag;
+  entry->seq = cpu->dispatch_seq++;
+
+  bit_set(cpu->iq_used, getIQ);
+  for (uint32_t m = stage->br_mask; m; m &= m - 1)
+  {
+    bit_set(&cpu->iq_branch[__builtin_ctz(m) * cpu->iq_words], getIQ);
+  }
+  cpu->iq_count++;
+  if (entry->pending & (1 << OPND_RS1))
+  {
+    bit_set(&cpu->iq_waiters[entry->prs1 * cpu->iq_words], getIQ);
+  }
+  if (entry->pending & (1 << OPND_RS2))
+  {
+    bit_set(&cpu->iq_waiters[entry->prs2 * cpu->iq_words], getIQ);
+  }
+  if (entry->pending & (1 << OPND_RS3))
+  {
+    bit_set(&cpu->iq_waiters[entry->prs3 * cpu->iq_words], getIQ);
+  }
+  if (!entry->pending)
   {
+    bit_set(cpu->iq_ready[issue_class(entry->op)], getIQ);
+  }
+  return 0;
+}
 
-    cpu->stage[F].stalled = 1;
-    cpu->stage[DRF].stalled = 1;
-    cpu->haltflag = 0;
+/*
+ * Allocates the LSQ entry at the tail for a dispatched memory instruction
+ * and returns its index. The address is filled in by the INT unit, and a
+ * store's data now or from the result bus
+ *
+ * Note : update_stalls() holds decode while the LSQ is full
+ */
+int get_LSQ(APEX_CPU *cpu, CPU_Stage *stage)
+{
+  int getLSQ = fetch_LSQ(cpu);
+  lsq *entry = &cpu->LSQ[getLSQ];
+
+  memset(entry, 0, sizeof(*entry));
+  entry->pc = stage->pc;
+  entry->imm = stage->imm;
+  entry->op = stage->op;
+  entry->rd = stage->rd;
+  entry->rs1 = stage->rs1;
+  entry->rs2 = stage->rs2;
+  entry->rs3 = stage->rs3;
+  entry->prd = stage->prd;
+  entry->rob = stage->rob;
+  if (is_store(stage->op))
+  {
+    entry->data = stage->rs1_value;
+    entry->data_tag = stage->prs1;
+    entry->data_valid = !(stage->pending & (1 << OPND_RS1));
+    if (!entry->data_valid)
+    {
+      bit_set(&cpu->lsq_waiters[stage->prs1 * cpu->lsq_words], getLSQ);
+    }
   }
+
+  for (uint32_t m = stage->br_mask; m; m &= m - 1)
+  {
+    bit_set(&cpu->lsq_branch[__builtin_ctz(m) * cpu->lsq_words], getLSQ);
+  }
+
+  cpu->lsq_tail = (cpu->lsq_tail + 1) % cpu->config.lsq_size;
+  cpu->lsq_count++;
+  return getLSQ;
+}
+
+/*
+ * Allocates the ROB entry at the tail for a dispatched instruction and
+ * returns its index. HALT has nothing to execute and is done at once
+ *
+ * Note : update_stalls() holds decode while the ROB is full
+ */
+int get_ROB(APEX_CPU *cpu, CPU_Stage *stage)
+{
+  int getROB = fetch_ROB(cpu);
+
+  cpu->ROB[getROB].pc = stage->pc;
+  cpu->ROB[getROB].imm = stage->imm;
+  cpu->ROB[getROB].op = stage->op;
   cpu->ROB[getROB].rd = stage->rd;
   cpu->ROB[getROB].rs1 = stage->rs1;
   cpu->ROB[getROB].rs2 = stage->rs2;
-  cpu->ROB[getROB].get_data = 1;
-  // cpu->ins_completed++;
+  cpu->ROB[getROB].prd = stage->prd;
+  cpu->ROB[getROB].ghr = stage->ghr;
+  cpu->ROB[getROB].taken = 0;
+  cpu->ROB[getROB].mispredicted = 0;
+  cpu->ROB[getROB].done = stage->op == OP_HALT;
+
+  cpu->rob_tail = (cpu->rob_tail + 1) % cpu->config.rob_size;
+  cpu->rob_count++;
+  return getROB;
+}
+
+/*
+ * Discards every ROB entry younger than 'index', which becomes the tail
+ * entry
+ */
+void ROB_Flush(APEX_CPU *cpu, int index)
+{
+  int size = cpu->config.rob_size;
+  cpu->rob_tail = (index + 1) % size;
+  cpu->rob_count = (index - cpu->rob_head + size) % size + 1;
+}
+
+/*
+ * Branch mask of queue entry 'i', from the per-tag bitsets of the queue
+ */
+static uint32_t
+branch_mask(APEX_CPU *cpu, const APEX_Bits *sets, int words, int i)
+{
+  uint32_t mask = 0;
+  for (uint32_t m = cpu->br_active; m; m &= m - 1)
+  {
+    int tag = __builtin_ctz(m);
+    if (bit_test(&sets[tag * words], i))
+    {
+      mask |= 1u << tag;
+    }
+  }
+  return mask;
+}
+
+/*
+ * Frees the tags in 'tags' and removes them from every branch mask,
+ * including those of the snapshots
+ */
+static void
+release_tags(APEX_CPU *cpu, uint32_t tags)
+{
+  for (uint32_t m = tags; m; m &= m - 1)
+  {
+    int tag = __builtin_ctz(m);
+    memset(&cpu->iq_branch[tag * cpu->iq_words], 0,
+           cpu->iq_words * sizeof(APEX_Bits));
+    memset(&cpu->lsq_branch[tag * cpu->lsq_words], 0,
+           cpu->lsq_words * sizeof(APEX_Bits));
+  }
+  for (int i = 0; i < cpu->num_stages; ++i)
+  {
+    cpu->stage[i].br_mask &= ~tags;
+  }
+  /* A tag given out again must not tie a newer branch to older ones */
+  for (int tag = 0; tag < APEX_MAX_BRANCH_TAGS; ++tag)
+  {
+    cpu->snapshots[tag].br_mask &= ~tags;
+  }
+  cpu->br_active &= ~tags;
+}
+
+/*
+ * A correctly predicted branch frees its tag
+ */
+static void
+branch_resolved(APEX_CPU *cpu, CPU_Stage *branch)
+{
+  release_tags(cpu, 1u << branch->br_tag);
+}
+
+/*
+ * Recovers from a mispredicted branch: only the instructions carrying its
+ * tag are squashed, from the latches, the IQ, the LSQ and the ROB, and
+ * the rename state is restored from the branch's snapshot. The work done
+ * does not grow with the number of instructions in flight
+ */
+static void
+branch_squash(APEX_CPU *cpu, CPU_Stage *branch)
+{
+  uint32_t bit = 1u << branch->br_tag;
+  APEX_Snapshot *snap = &cpu->snapshots[branch->br_tag];
+
+  /* Decode holds instructions that have no tags yet but are always
+   * younger than the branch
+   */
+  for (int i = DRF; i < cpu->num_stages; ++i)
+  {
+    CPU_Stage *stage = &cpu->stage[i];
+    if (!stage->busy &&
+        (i < front_latch(cpu, IQ, 0) || (stage->br_mask & bit)))
+    {
+      stage->busy = 1;
+      stage->stalled = 0;
+    }
+  }
+  /* A HALT on the wrong path no longer holds fetch */
+  cpu->stage[F].stalled = 0;
+
+  /* Squashed queue entries also leave the sets of the older branches */
+  APEX_Bits *iq_younger = &cpu->iq_branch[branch->br_tag * cpu->iq_words];
+  APEX_Bits *lsq_younger = &cpu->lsq_branch[branch->br_tag * cpu->lsq_words];
+  for (uint32_t m = cpu->br_active & ~bit; m; m &= m - 1)
+  {
+    int tag = __builtin_ctz(m);
+    for (int w = 0; w < cpu->iq_words; ++w)
+    {
+      cpu->iq_branch[tag * cpu->iq_words + w] &= ~iq_younger[w];
+    }
+    for (int w = 0; w < cpu->lsq_words; ++w)
+    {
+      cpu->lsq_branch[tag * cpu->lsq_words + w] &= ~lsq_younger[w];
+    }
+  }
+
+  for (int w = 0; w < cpu->iq_words; ++w)
+  {
+    APEX_Bits squashed = iq_younger[w] & cpu->iq_used[w];
+    cpu->iq_used[w] &= ~squashed;
+    for (int fu = 0; fu < NUM_FU_CLASSES; ++fu)
+    {
+      cpu->iq_ready[fu][w] &= ~squashed;
+    }
+    cpu->iq_count -= __builtin_popcountll(squashed);
+  }
+
+  /* The younger LSQ entries are the ones at its tail */
+  int lsq_younger_count = 0;
+  for (int w = 0; w < cpu->lsq_words; ++w)
+  {
+    lsq_younger_count += __builtin_popcountll(lsq_younger[w]);
+  }
+  cpu->lsq_count -= lsq_younger_count;
+  cpu->lsq_tail = (cpu->lsq_tail - lsq_younger_count + cpu->config.lsq_size) %
+                  cpu->config.lsq_size;
+
+  int rob_size = cpu->config.rob_size;
+  int kept = (branch->rob - cpu->rob_head + rob_size) % rob_size + 1;
+  cpu->ins_squashed += cpu->rob_count - kept;
+  ROB_Flush(cpu, branch->rob);
+
+  /* Registers renamed behind the branch are free again */
+  APEX_Bits *alloc = &cpu->br_alloc[branch->br_tag * cpu->tag_words];
+  for (int w = 0; w < cpu->tag_words; ++w)
+  {
+    cpu->free_count += __builtin_popcountll(alloc[w] & ~cpu->prf_free[w]);
+    cpu->prf_free[w] |= alloc[w];
+  }
+  memcpy(cpu->rename_table, snap->rename_table, sizeof(cpu->rename_table));
+  cpu->z_rob = snap->z_rob;
+
+  /* The branch and the younger ones on the wrong path give up their tag */
+  uint32_t tags = bit;
+  for (uint32_t m = cpu->br_active; m; m &= m - 1)
+  {
+    int tag = __builtin_ctz(m);
+    if (cpu->snapshots[tag].br_mask & bit)
+    {
+      tags |= 1u << tag;
+    }
+  }
+  release_tags(cpu, tags);
 }
 
 int printI(APEX_CPU *cpu)
 {
-  for (int i = 0; i < 8; i++)
+  for (int i = bits_next(cpu->iq_used, cpu->iq_words, 0); i >= 0;
+       i = bits_next(cpu->iq_used, cpu->iq_words, i + 1))
+  {
+    printf("\n IQ ");
+    print_fields(cpu->IQ[i].op, cpu->IQ[i].rd, cpu->IQ[i].rs1,
+                 cpu->IQ[i].rs2, cpu->IQ[i].rs3, cpu->IQ[i].imm);
+    printf("\n");
+  }
+  return 0;
+}
+
+int printROB(APEX_CPU *cpu)
+{
+  for (int n = 0; n < cpu->rob_count; ++n)
   {
-    if (cpu->IQ[i].get_data == 1)
+    int i = (cpu->rob_head + n) % cpu->config.rob_size;
+    printf("\n ROB%s ", cpu->ROB[i].done ? "*" : "");
+    print_fields(cpu->ROB[i].op, cpu->ROB[i].rd, cpu->ROB[i].rs1,
+                 cpu->ROB[i].rs2, 0, cpu->ROB[i].imm);
+    printf("\n");
+  }
+  return 0;
+}
+
+int printLSQ(APEX_CPU *cpu)
+{
+  for (int n = 0; n < cpu->lsq_count; ++n)
+  {
+    int i = (cpu->lsq_head + n) % cpu->config.lsq_size;
+    if (cpu->LSQ[i].addr_valid)
     {
-      if (strcmp(cpu->IQ[i].opcode, "ADD") == 0 || strcmp(cpu->IQ[i].opcode, "SUB") == 0 || strcmp(cpu->IQ[i].opcode, "AND") == 0 || strcmp(cpu->IQ[i].opcode, "OR") == 0 || strcmp(cpu->IQ[i].opcode, "XOR") == 0 || strcmp(cpu->IQ[i].opcode, "MUL") == 0)
-      {
-        printf("\n IQ %s R%d R%d R%d \n", cpu->IQ[i].opcode, cpu->IQ[i].rd, cpu->IQ[i].rs1, cpu->IQ[i].rs2);
-      }
+      printf("\n LSQ [%d] ", cpu->LSQ[i].mem_address);
+    }
+    else
+    {
+      printf("\n LSQ ");
+    }
+    print_fields(cpu->LSQ[i].op, cpu->LSQ[i].rd, cpu->LSQ[i].rs1,
+                 cpu->LSQ[i].rs2, cpu->LSQ[i].rs3, cpu->LSQ[i].imm);
+    printf("\n");
+  }
+  return 0;
+}
 
-      if (strcmp(cpu->IQ[i].opcode, "ADDL") == 0 || strcmp(cpu->IQ[i].opcode, "SUBL") == 0)
-      {
-        printf("\n IQ %s R%d R%d \n", cpu->IQ[i].opcode, cpu->IQ[i].rd, cpu->IQ[i].rs1, cpu->IQ[i].imm);
-      }
+/*
+ * A store is done once both its address and its data are in the LSQ
+ */
+static void
+store_check_done(APEX_CPU *cpu, int i)
+{
+  lsq *entry = &cpu->LSQ[i];
+  if (entry->addr_valid && entry->data_valid)
+  {
+    cpu->ROB[entry->rob].done = 1;
+  }
+}
 
-      if (strcmp(cpu->IQ[i].opcode, "LDR") == 0 || strcmp(cpu->IQ[i].opcode, "STR") == 0)
-      {
-        printf("\n IQ %s R%d R%d R%d \n", cpu->IQ[i].opcode, cpu->IQ[i].rd, cpu->IQ[i].rs1, cpu->IQ[i].rs2);
-      }
+/*
+ * Returns 1 if LSQ entry 'i' holds an instruction
+ */
+static int
+lsq_live(APEX_CPU *cpu, int i)
+{
+  int size = cpu->config.lsq_size;
+  return (i - cpu->lsq_head + size) % size < cpu->lsq_count;
+}
 
-      if (strcmp(cpu->IQ[i].opcode, "LOAD") == 0 || strcmp(cpu->IQ[i].opcode, "STORE") == 0)
-      {
-        printf("\n IQ %s R%d R%d R%d \n", cpu->IQ[i].opcode, cpu->IQ[i].rs1, cpu->IQ[i].rs2, cpu->IQ[i].rs3);
-      }
+/*
+ * Broadcasts the result of physical register 'tag' on the result bus:
+ * every IQ entry subscribed to it, the instructions waiting in the IQ
+ * latch and stores in the LSQ waiting for their data capture the value.
+ * IQ entries left with no pending source become ready to issue
+ */
+static void
+wakeup(APEX_CPU *cpu, int tag, int value)
+{
+  APEX_Bits *waiters = &cpu->iq_waiters[tag * cpu->iq_words];
+
+  for (int i = bits_next(waiters, cpu->iq_words, 0); i >= 0;
+       i = bits_next(waiters, cpu->iq_words, i + 1))
+  {
+    /* Entries squashed while waiting leave their bit behind */
+    if (!bit_test(cpu->iq_used, i))
+    {
+      continue;
+    }
+    iq *entry = &cpu->IQ[i];
+    if ((entry->pending & (1 << OPND_RS1)) && entry->prs1 == tag)
+    {
+      entry->rs1_value = value;
+      entry->pending &= ~(1 << OPND_RS1);
+    }
+    if ((entry->pending & (1 << OPND_RS2)) && entry->prs2 == tag)
+    {
+      entry->rs2_value = value;
+      entry->pending &= ~(1 << OPND_RS2);
+    }
+    if ((entry->pending & (1 << OPND_RS3)) && entry->prs3 == tag)
+    {
+      entry->rs3_value = value;
+      entry->pending &= ~(1 << OPND_RS3);
+    }
+    if (!entry->pending)
+    {
+      bit_set(cpu->iq_ready[issue_class(entry->op)], i);
+    }
+  }
+  memset(waiters, 0, cpu->iq_words * sizeof(APEX_Bits));
+
+  for (int s = 0; s < cpu->config.fetch_width; ++s)
+  {
+    CPU_Stage *latch = &cpu->stage[front_latch(cpu, IQ, s)];
+    if (latch->busy || !latch->pending)
+    {
+      continue;
+    }
+    if ((latch->pending & (1 << OPND_RS1)) && latch->prs1 == tag)
+    {
+      latch->rs1_value = value;
+      latch->pending &= ~(1 << OPND_RS1);
+    }
+    if ((latch->pending & (1 << OPND_RS2)) && latch->prs2 == tag)
+    {
+      latch->rs2_value = value;
+      latch->pending &= ~(1 << OPND_RS2);
+    }
+    if ((latch->pending & (1 << OPND_RS3)) && latch->prs3 == tag)
+    {
+      latch->rs3_value = value;
+      latch->pending &= ~(1 << OPND_RS3);
+    }
+  }
 
-      if (strcmp(cpu->IQ[i].opcode, "BZ") == 0 || strcmp(cpu->IQ[i].opcode, "BNZ") == 0)
+  waiters = &cpu->lsq_waiters[tag * cpu->lsq_words];
+  for (int i = bits_next(waiters, cpu->lsq_words, 0); i >= 0;
+       i = bits_next(waiters, cpu->lsq_words, i + 1))
+  {
+    lsq *entry = &cpu->LSQ[i];
+    if (lsq_live(cpu, i) && !entry->data_valid && entry->data_tag == tag)
+    {
+      entry->data = value;
+      entry->data_valid = 1;
+      store_check_done(cpu, i);
+    }
+  }
+  memset(waiters, 0, cpu->lsq_words * sizeof(APEX_Bits));
+}
+
+/*
+ * Selects the oldest ready IQ entry of the classes in 'accepts', or -1
+ */
+static int
+select_oldest(APEX_CPU *cpu, int accepts)
+{
+  int oldest = -1;
+
+  for (int fu = 0; fu < NUM_FU_CLASSES; ++fu)
+  {
+    if (!(accepts & (1 << fu)))
+    {
+      continue;
+    }
+    const APEX_Bits *ready = cpu->iq_ready[fu];
+    for (int i = bits_next(ready, cpu->iq_words, 0); i >= 0;
+         i = bits_next(ready, cpu->iq_words, i + 1))
+    {
+      if (oldest < 0 || (int32_t)(cpu->IQ[i].seq - cpu->IQ[oldest].seq) < 0)
       {
-        printf("\n IQ %s  \n", cpu->IQ[i].opcode, cpu->IQ[i].imm);
+        oldest = i;
       }
+    }
+  }
+  return oldest;
+}
+
+/*
+ * Returns 1 if 'unit' can take an instruction into its first stage in the
+ * next cycle: a pipelined unit unless its first stage is held, and one
+ * that is not pipelined once its instruction leaves the last stage
+ */
+static int
+unit_free(APEX_CPU *cpu, APEX_Unit *unit)
+{
+  CPU_Stage *stages = &cpu->stage[unit->first_stage];
+  if (unit->pipelined)
+  {
+    return !stages[0].stalled;
+  }
+  for (int k = 0; k < unit->latency - 1; ++k)
+  {
+    if (!stages[k].busy)
+    {
+      return 0;
+    }
+  }
+  return !stages[unit->latency - 1].stalled;
+}
 
-      if (strcmp(cpu->IQ[i].opcode, "JUMP") == 0)
+/*
+ * Moves IQ entry 'i' into the first stage of 'unit' for the next cycle
+ */
+static void
+issue(APEX_CPU *cpu, int i, APEX_Unit *unit)
+{
+  iq *entry = &cpu->IQ[i];
+  CPU_Stage *out = &cpu->next[unit->first_stage];
+
+  memset(out, 0, sizeof(*out));
+  out->pc = entry->pc;
+  out->pred_pc = entry->pred_pc;
+  out->ghr = entry->ghr;
+  out->imm = entry->imm;
+  out->op = entry->op;
+  out->rd = entry->rd;
+  out->rs1 = entry->rs1;
+  out->rs2 = entry->rs2;
+  out->rs3 = entry->rs3;
+  out->rs1_value = entry->rs1_value;
+  out->rs2_value = entry->rs2_value;
+  out->rs3_value = entry->rs3_value;
+  out->prd = entry->prd;
+  out->rob = entry->rob;
+  out->lsq = entry->lsq;
+  out->br_tag = entry->br_tag;
+  out->br_mask = branch_mask(cpu, cpu->iq_branch, cpu->iq_words, i);
+
+  bit_clear(cpu->iq_used, i);
+  bit_clear(cpu->iq_ready[issue_class(entry->op)], i);
+  cpu->iq_count--;
+}
+
+/*
+ * Finds the oldest load in the LSQ that can go to a MEM unit: its address
+ * is known and so is the address of every older store, so the load can
+ * bypass stores to other addresses. The youngest older store to the same
+ * address, if any, is returned through 'from' to forward its data once
+ * it has it. A load sent back from a MEM unit goes again at its 'fill'
+ * cycle: to arrive in the last stage with its MSHR fill, or when an MSHR
+ * frees.
+ * Returns the LSQ index of the load, or -1
+ */
+static int
+select_load(APEX_CPU *cpu, int *from)
+{
+  int size = cpu->config.lsq_size;
+
+  for (int n = 0; n < cpu->lsq_count; ++n)
+  {
+    int i = (cpu->lsq_head + n) % size;
+    lsq *entry = &cpu->LSQ[i];
+    if (is_store(entry->op))
+    {
+      if (!entry->addr_valid)
       {
-        printf("\n IQ %s R%d \n", cpu->IQ[i].opcode, cpu->IQ[i].rs1, cpu->IQ[i].imm);
+        return -1;
       }
+      continue;
+    }
+    if (entry->issued || !entry->addr_valid || entry->fill > cpu->clock)
+    {
+      continue;
+    }
 
-      if (strcmp(cpu->IQ[i].opcode, "MOVC") == 0)
+    *from = -1;
+    for (int m = n - 1; m >= 0; --m)
+    {
+      int j = (cpu->lsq_head + m) % size;
+      if (is_store(cpu->LSQ[j].op) &&
+          cpu->LSQ[j].mem_address == entry->mem_address)
       {
-        printf("\n IQ %s R%d \n", cpu->IQ[i].opcode, cpu->IQ[i].rd, cpu->IQ[i].imm);
+        *from = j;
+        break;
       }
     }
+    /* The load waits for the data of the store it forwards from */
+    if (*from >= 0 && !cpu->LSQ[*from].data_valid)
+    {
+      continue;
+    }
+    return i;
   }
+  return -1;
 }
 
-int printROB(APEX_CPU *cpu)
+/*
+ *  LSQ Stage: every MEM unit is granted the oldest load that is free to
+ *  go, carrying the value of a matching older store if there is one.
+ *  Stores stay in the LSQ and write memory when they commit
+ */
+int lsqstage(APEX_CPU *cpu)
 {
-  for (int i = 0; i < 12; i++)
+  for (int u = 0; u < cpu->num_units; ++u)
   {
+    APEX_Unit *unit = &cpu->units[u];
+    if (!(unit->accepts & (1 << FU_MEM)) || !unit_free(cpu, unit))
+    {
+      continue;
+    }
 
-    if (cpu->ROB[i].get_data == 1)
+    int from;
+    int i = select_load(cpu, &from);
+    if (i < 0)
     {
-      if (strcmp(cpu->ROB[i].opcode, "ADD") == 0 || strcmp(cpu->ROB[i].opcode, "SUB") == 0 || strcmp(cpu->ROB[i].opcode, "AND") == 0 || strcmp(cpu->ROB[i].opcode, "OR") == 0 || strcmp(cpu->ROB[i].opcode, "XOR") == 0 || strcmp(cpu->ROB[i].opcode, "MUL") == 0)
-      {
-        printf("\n ROB  %s R%d R%d R%d \n", cpu->ROB[i].opcode, cpu->ROB[i].rd, cpu->ROB[i].rs1, cpu->ROB[i].rs2);
-      }
+      break;
+    }
+
+    lsq *entry = &cpu->LSQ[i];
+    CPU_Stage *out = &cpu->next[unit->first_stage];
+    memset(out, 0, sizeof(*out));
+    out->pc = entry->pc;
+    out->imm = entry->imm;
+    out->op = entry->op;
+    out->rd = entry->rd;
+    out->rs1 = entry->rs1;
+    out->rs2 = entry->rs2;
+    out->prd = entry->prd;
+    out->rob = entry->rob;
+    out->lsq = i;
+    out->br_mask = branch_mask(cpu, cpu->lsq_branch, cpu->lsq_words, i);
+    out->mem_address = entry->mem_address;
+    if (from >= 0)
+    {
+      out->buffer = cpu->LSQ[from].data;
+      out->forwarded = 1;
+    }
+    /* A load replayed for its MSHR fill does not access the cache again */
+    out->accessed = entry->missed;
+    entry->issued = 1;
+  }
+
+  if (front_occupied(cpu, LSQ) && DEBUG_MESSAGES(cpu))
+  {
+    printLSQ(cpu);
+    printf("LSQ Stage");
+  }
+  return 0;
+}
+
+/*
+ *  ROB Stage: dispatched instructions already hold the ROB entries
+ *  decode allocated for them; a HALT here stops fetch (see update_stalls)
+ */
+int robstage(APEX_CPU *cpu)
+{
+  if (front_occupied(cpu, ROB) && DEBUG_MESSAGES(cpu))
+  {
+    printROB(cpu);
+  }
+  return 0;
+}
+
+/*
+ *  IQ Stage: the dispatched instructions enter the queue in program
+ *  order, then every free unit fed by the IQ is granted the oldest ready
+ *  entry it accepts. Pipelined units take a new instruction every cycle
+ */
+int iqstage(APEX_CPU *cpu)
+{
+  for (int s = 0; s < cpu->config.fetch_width; ++s)
+  {
+    CPU_Stage *stage = &cpu->stage[front_latch(cpu, IQ, s)];
+    if (!stage->busy && !stage->stalled)
+    {
+      get_I(cpu, stage);
+    }
+  }
+
+  for (int u = 0; u < cpu->num_units; ++u)
+  {
+    APEX_Unit *unit = &cpu->units[u];
+    if ((unit->accepts & (1 << FU_MEM)) || !unit_free(cpu, unit))
+    {
+      continue;
+    }
+    int i = select_oldest(cpu, unit->accepts);
+    if (i < 0)
+    {
+      continue;
+    }
+    issue(cpu, i, unit);
+  }
 
-      if (strcmp(cpu->IQ[i].opcode, "ADDL") == 0 || strcmp(cpu->IQ[i].opcode, "SUBL") == 0)
+  if (DEBUG_MESSAGES(cpu) && cpu->iq_count > 0)
+  {
+    printI(cpu);
+  }
+  return 0;
+}
+
+/*
+ *  Stage k (0-based) of a functional unit: the instruction moves to the
+ *  next stage of the unit, or to the unit's retire latch from the last
+ *  stage. The operation itself is performed by complete() in the last
+ *  stage
+ *
+ *  Note : You are free to edit this function according to your
+ * 				 implementation
+ */
+int fustage(APEX_CPU *cpu, int u, int k)
+{
+  APEX_Unit *unit = &cpu->units[u];
+  CPU_Stage *stage = &cpu->stage[unit->first_stage + k];
+
+  if (!stage->busy && !stage->stalled)
+  {
+    cpu->next[unit->first_stage + k + 1] = *stage;
+
+    if (DEBUG_MESSAGES(cpu))
+    {
+      char name[32];
+      if (unit->number > 1)
       {
-        printf("\n ROB %s R%d R%d \n", cpu->ROB[i].opcode, cpu->ROB[i].rd, cpu->ROB[i].rs1, cpu->ROB[i].imm);
+        snprintf(name, sizeof(name), "%s%d FU %d",
+                 unit_classes[unit->fu].name, unit->number, k + 1);
       }
-
-      if (strcmp(cpu->IQ[i].opcode, "LDR") == 0 || strcmp(cpu->IQ[i].opcode, "STR") == 0)
+      else
       {
-        printf("\n ROB %s R%d R%d R%d \n", cpu->ROB[i].opcode, cpu->ROB[i].rd, cpu->ROB[i].rs1, cpu->ROB[i].rs2);
+        snprintf(name, sizeof(name), "%s FU %d",
+                 unit_classes[unit->fu].name, k + 1);
       }
+      print_stage_content(name, stage);
+    }
+  }
+  return 0;
+}
+
+/*
+ *  Retire stage: the instruction in the retire latch of every unit marks
+ *  its ROB entry done, then the ROB commits
+ */
+int retire(APEX_CPU *cpu)
+{
+  for (int u = 0; u < cpu->num_units; ++u)
+  {
+    CPU_Stage *stage = &cpu->stage[cpu->units[u].ret_stage];
+    if (stage->busy || stage->stalled)
+    {
+      continue;
+    }
+
+    /* Memory instructions pass an INT unit for their address first.
+     * Loads are done once they leave the MEM unit, stores once their
+     * address and data are in the LSQ (see store_check_done())
+     */
+    if (apex_op_info[stage->op].fu != FU_MEM || cpu->units[u].fu == FU_MEM)
+    {
+      cpu->ROB[stage->rob].done = 1;
+    }
+
+    if (DEBUG_MESSAGES(cpu))
+    {
+      print_stage_content("RET", stage);
+    }
+  }
+  commit(cpu);
+  return 0;
+}
+
+/*
+ * Stops the run at a load or store of pc 'pc' outside data memory,
+ * reporting the access. Returns 1 if 'address' is outside
+ */
+static int
+mem_fault(APEX_CPU *cpu, int pc, int address)
+{
+  if (address >= 0 && address < cpu->config.data_memory_size)
+  {
+    return 0;
+  }
+  cpu->faulted = 1;
+  cpu->fault_pc = pc;
+  cpu->fault_address = address;
+  cpu->haltflag = 1;
+  fprintf(stderr,
+          "APEX_Error : pc(%d) accesses data memory word %d, outside [0, "
+          "%d)\n",
+          pc, address, cpu->config.data_memory_size);
+  return 1;
+}
 
-      if (strcmp(cpu->IQ[i].opcode, "LOAD") == 0 || strcmp(cpu->IQ[i].opcode, "STORE") == 0)
+/*
+ *  Commit: up to commit_width done entries leave the head of the ROB in
+ *  program order, updating the architectural registers. The program ends
+ *  when its HALT commits, or a load or store outside data memory reaches
+ *  the head of the ROB
+ */
+int commit(APEX_CPU *cpu)
+{
+  for (int n = 0; n < cpu->config.commit_width && cpu->rob_count > 0; ++n)
+  {
+    rob *entry = &cpu->ROB[cpu->rob_head];
+    if (!entry->done)
+    {
+      break;
+    }
+
+    /* Memory instructions leave the head of the LSQ, and stores write
+     * memory now that they are no longer speculative. An access outside
+     * data memory stops the run before the instruction commits
+     */
+    if (apex_op_info[entry->op].fu == FU_MEM)
+    {
+      lsq *mem = &cpu->LSQ[cpu->lsq_head];
+      if (mem_fault(cpu, mem->pc, mem->mem_address))
       {
-        printf("\n ROB %s R%d R%d R%d \n", cpu->ROB[i].opcode, cpu->ROB[i].rs1, cpu->ROB[i].rs2, cpu->IQ[i].rs3);
+        break;
       }
-
-      if (strcmp(cpu->IQ[i].opcode, "BZ") == 0 || strcmp(cpu->IQ[i].opcode, "BNZ") == 0)
+      if (is_store(mem->op))
       {
-        printf("\n ROB %s  \n", cpu->ROB[i].opcode, cpu->ROB[i].imm);
+        apex_memory_write(cpu, mem->mem_address, mem->data);
+        apex_cache_access(cpu, mem->mem_address, 1);
+        apex_prefetch_observe(cpu, mem->pc, mem->mem_address);
       }
+      cpu->lsq_head = (cpu->lsq_head + 1) % cpu->config.lsq_size;
+      cpu->lsq_count--;
+    }
 
-      if (strcmp(cpu->IQ[i].opcode, "JUMP") == 0)
+    /* The result becomes architectural, and the register Rd was mapped
+     * to before the instruction is no longer read by anyone
+     */
+    if (apex_formats[apex_op_info[entry->op].format].writes_rd)
+    {
+      cpu->regs[entry->rd] = cpu->prf[entry->prd];
+      cpu->arch_map[entry->rd] = entry->prd;
+      free_PR(cpu, entry->prev_prd);
+    }
+    if (sets_zero_flag(entry->op))
+    {
+      cpu->z_flag = cpu->prf[entry->prd] == 0;
+      if (cpu->z_rob == cpu->rob_head)
       {
-        printf("\n ROB %s R%d \n", cpu->ROB[i].opcode, cpu->ROB[i].rs1, cpu->ROB[i].imm);
+        cpu->z_rob = -1;
       }
-
-      if (strcmp(cpu->IQ[i].opcode, "MOVC") == 0)
+      for (uint32_t m = cpu->br_active; m; m &= m - 1)
       {
-        printf("\n ROB %s R%d \n", cpu->ROB[i].opcode, cpu->ROB[i].rd, cpu->ROB[i].imm);
+        APEX_Snapshot *snap = &cpu->snapshots[__builtin_ctz(m)];
+        if (snap->z_rob == cpu->rob_head)
+        {
+          snap->z_rob = -1;
+        }
       }
     }
+    if (is_branch(entry->op))
+    {
+      apex_bpred_update(cpu, entry);
+    }
+
+    cpu->ins_completed++;
+    cpu->rob_head = (cpu->rob_head + 1) % cpu->config.rob_size;
+    cpu->rob_count--;
+
+    if (DEBUG_MESSAGES(cpu))
+    {
+      printf("%-15s: pc(%d) ", "Commit", entry->pc);
+      print_fields(entry->op, entry->rd, entry->rs1, entry->rs2, 0,
+                   entry->imm);
+      printf("\n");
+    }
+
+    if (entry->op == OP_HALT)
+    {
+      cpu->haltflag = 1;
+      break;
+    }
   }
+  return 0;
 }
 
-int printLSQ(APEX_CPU *cpu)
+int display(APEX_CPU *cpu)
 {
-  for (int i = 0; i < 6; i++)
+  printf("\n");
+    printf("==================REGISTER VALUE==============");
+    for (int i = 0; i < 16; i++)
+    {
+      printf("\n");
+      printf(" | Register[%d] | Value=%d | status=%s |", i, cpu->regs[i], bit_test(cpu->reg_ready, cpu->rename_table[i]) ? "Valid" : "Invalid");
+    }
+
+    printf("\n");
+    printf("==================DATA MEMORY ==============");
+    printf("\n");
+    for (int i = 0; i < 99 && i < cpu->config.data_memory_size; i++)
+    {
+      printf(" | MEM[%d] | Value=%d | \n", i, apex_memory_read(cpu, i));
+    }
+  return 0;
+}
+/*
+ * Returns 1 if the instruction in the last stage of 'unit' produces a
+ * register result, which needs a slot on the result bus. Loads produce it
+ * in a MEM unit, other instructions in the unit they issued to
+ */
+static int
+needs_cdb(APEX_Unit *unit, CPU_Stage *stage)
+{
+  return (apex_op_info[stage->op].fu == FU_MEM) == (unit->fu == FU_MEM) &&
+         apex_formats[apex_op_info[stage->op].format].writes_rd;
+}
+
+/*
+ * Operation 'unit' performs on an instruction: a MEM unit accesses
+ * memory, and the other units execute the class it issued as
+ */
+static APEX_ExecFn
+unit_op(APEX_Unit *unit, int op)
+{
+  return unit->fu == FU_MEM ? mem_ops[op] : fu_ops[issue_class(op)][op];
+}
+
+/*
+ * Orders the units for result bus arbitration, by the configured policy
+ */
+static void
+cdb_order(APEX_CPU *cpu, int *order)
+{
+  int n = cpu->num_units;
+  int size = cpu->config.rob_size;
+
+  for (int i = 0; i < n; ++i)
+  {
+    order[i] = cpu->config.cdb_policy == CDB_ROUND_ROBIN
+                   ? (cpu->cdb_next + i) % n
+                   : i;
+  }
+  if (cpu->config.cdb_policy != CDB_OLDEST)
   {
+    return;
+  }
+
+  /* Insertion sort by ROB age, empty units last */
+  int age[n];
+  for (int i = 0; i < n; ++i)
+  {
+    APEX_Unit *unit = &cpu->units[i];
+    CPU_Stage *stage = &cpu->stage[unit->first_stage + unit->latency - 1];
+    age[i] = stage->busy ? INT_MAX
+                         : (stage->rob - cpu->rob_head + size) % size;
+  }
+  for (int i = 1; i < n; ++i)
+  {
+    int u = order[i];
+    int j = i - 1;
+    while (j >= 0 && age[order[j]] > age[u])
+    {
+      order[j + 1] = order[j];
+      j--;
+    }
+    order[j + 1] = u;
+  }
+}
+
+/*
+ * Instructions in the last stage of their unit complete in the first half
+ * of the cycle: the unit performs the operation, and results of the
+ * unit's own class are written to the physical register file and
+ * broadcast on the result bus, so decode reads the new value and waiting
+ * IQ entries can issue in the same cycle
+ *
+ * Note : The bus carries cdb_width results per cycle. A result that loses
+ * arbitration stays in the last stage of its unit, holding the stages
+ * behind it, and competes again in the next cycle
+ */
+static void
+complete(APEX_CPU *cpu)
+{
+  int order[cpu->num_units];
+  int granted = 0;
 
-    if (cpu->LSQ[i].get_data == 0)
+  cdb_order(cpu, order);
+  for (int n = 0; n < cpu->num_units; ++n)
+  {
+    APEX_Unit *unit = &cpu->units[order[n]];
+    CPU_Stage *stage = &cpu->stage[unit->first_stage + unit->latency - 1];
+    if (stage->busy)
     {
-      if (strcmp(cpu->LSQ[i].opcode, "LDR") == 0)
+      stage->stalled = 0;
+      continue;
+    }
+
+    /* A load reads the data cache in the last stage of its MEM unit, and
+     * holds the unit while the access takes more than a cycle. A load
+     * that misses into an MSHR leaves the unit instead, and the LSQ
+     * issues it again to arrive with the fill; with every MSHR in use, it
+     * goes back to the LSQ until the first one frees
+     */
+    if (unit->fu == FU_MEM && mem_ops[stage->op] && !stage->forwarded)
+    {
+      if (!stage->accessed)
       {
-        printf("\n LSQ %s R%d R%d R%d \n", cpu->LSQ[i].opcode, cpu->LSQ[i].rd, cpu->LSQ[i].rs1, cpu->LSQ[i].rs2);
+        int cycles;
+        int hit = apex_cache_load(cpu, stage->mem_address, &cycles);
+        if (hit >= 0)
+        {
+          apex_prefetch_observe(cpu, stage->pc, stage->mem_address);
+        }
+        if (hit <= 0)
+        {
+          lsq *entry = &cpu->LSQ[stage->lsq];
+          entry->missed = hit == 0;
+          entry->issued = 0;
+          entry->fill = cpu->clock + cycles - 1 - unit->latency;
+          stage->busy = 1;
+          stage->stalled = 0;
+          continue;
+        }
+        stage->accessed = 1;
+        stage->mem_wait = cycles - 1;
       }
+      if (stage->mem_wait > 0)
+      {
+        stage->mem_wait--;
+        stage->stalled = 1;
+        continue;
+      }
+    }
+
+    int broadcast = needs_cdb(unit, stage);
+    stage->stalled = broadcast && granted == cpu->config.cdb_width;
+    if (stage->stalled)
+    {
+      continue;
+    }
+    if (broadcast)
+    {
+      granted++;
+      cpu->cdb_next = (order[n] + 1) % cpu->num_units;
+    }
+
+    APEX_ExecFn exec = unit_op(unit, stage->op);
+    if (exec)
+    {
+      exec(cpu, stage);
+    }
 
-      if (strcmp(cpu->LSQ[i].opcode, "STR") == 0)
+    /* Addresses computed by an INT unit go to the LSQ */
+    if (apex_op_info[stage->op].fu == FU_MEM && unit->fu != FU_MEM)
+    {
+      lsq *entry = &cpu->LSQ[stage->lsq];
+      entry->mem_address = stage->mem_address;
+      entry->addr_valid = 1;
+      if (is_store(stage->op))
       {
-        printf("\n LSQ %s R%d R%d R%d \n", cpu->LSQ[i].opcode, cpu->LSQ[i].rs1, cpu->LSQ[i].rs2, cpu->LSQ[i].rs3);
+        store_check_done(cpu, stage->lsq);
       }
-
-      if (strcmp(cpu->LSQ[i].opcode, "LOAD") == 0)
+    }
+    /* Branches resolve in the INT unit, and a misprediction redirects
+     * fetch to the resolved pc after squashing the wrong path
+     */
+    if (is_branch(stage->op))
+    {
+      rob *entry = &cpu->ROB[stage->rob];
+      entry->target = stage->buffer;
+      entry->taken = stage->op == OP_JUMP ||
+                     (stage->op == OP_BZ) == (stage->rs1_value == 0);
+      if (stage->buffer != stage->pred_pc)
       {
-        printf("\n LSQ %s R%d R%d R%d \n", cpu->LSQ[i].opcode, cpu->LSQ[i].rd, cpu->LSQ[i].rs1, cpu->LSQ[i].imm);
+        int shifted = cpu->snapshots[stage->br_tag].ghr_shifted;
+        entry->mispredicted = 1;
+        branch_squash(cpu, stage);
+        apex_bpred_recover(cpu, stage->ghr, shifted, entry->taken);
+        cpu->pc = stage->buffer;
       }
-
-      if (strcmp(cpu->LSQ[i].opcode, "STORE") == 0)
+      else
       {
-        printf("\n LSQ %s R%d R%d R%d \n", cpu->LSQ[i].opcode, cpu->LSQ[i].rs1, cpu->LSQ[i].rs2, cpu->LSQ[i].imm);
+        branch_resolved(cpu, stage);
       }
     }
-  }
-}
-
-int IQ_Squash(APEX_CPU *cpu, int pc)
-{
-  // int i = 0;
-
-  for (int i = 0; i < 8; i++)
-  {
-    if (cpu->IQ[i].get_data == 1)
+    if (broadcast)
     {
-
-      if (cpu->IQ[i].pc == pc)
-      {
-        //cpu->stage[IQ].stalled = 1;
-
-        return 0;
-      }
+      cpu->prf[stage->prd] = stage->buffer;
+      bit_set(cpu->reg_ready, stage->prd);
+      wakeup(cpu, stage->prd, stage->buffer);
     }
-    // i += 1;
   }
-  return 1;
-}
-
-int LSQ_Squash(APEX_CPU *cpu, int pc)
-{
-  // int i = 0;
 
-  for (int i = 0; i < 6; i++)
+  for (int u = 0; u < cpu->num_units; ++u)
   {
-    if (cpu->IQ[i].get_data == 1)
+    CPU_Stage *stages = &cpu->stage[cpu->units[u].first_stage];
+    for (int k = cpu->units[u].latency - 2; k >= 0; --k)
     {
-
-      if (cpu->IQ[i].pc == pc)
-      {
-        //cpu->stage[IQ].stalled = 1;
-
-        return 0;
-      }
+      stages[k].stalled = !stages[k].busy && stages[k + 1].stalled;
     }
-    // i += 1;
   }
-  return 1;
 }
 
-int get_int(APEX_CPU *cpu, int i)
+/*
+ * Stall signals derived from the current latch bank before any stage is
+ * evaluated
+ */
+static void
+update_stalls(APEX_CPU *cpu)
 {
-  CPU_Stage *stage = &cpu->stage[INT1];
-  stage->pc = cpu->IQ[i].pc;
-  stage->rd = cpu->IQ[i].rd;
-  stage->rs1 = cpu->IQ[i].rs1;
-  stage->rs2 = cpu->IQ[i].rs2;
-  cpu->IQ[i].get_data = 0;
-}
+  int width = cpu->config.fetch_width;
 
-int lsqstage(APEX_CPU *cpu)
-{
-  CPU_Stage *stage = &cpu->stage[LSQ];
-  if (!stage->busy && !stage->stalled)
+  /* A HALT entering the ROB stops fetch for good */
+  for (int s = 0; s < width; ++s)
   {
-    get_LSQ(cpu);
-    cpu->stage[MEM1] = cpu->stage[LSQ];
-    if (ENABLE_DEBUG_MESSAGES)
+    CPU_Stage *rob_latch = &cpu->stage[front_latch(cpu, ROB, s)];
+    if (!rob_latch->busy && rob_latch->op == OP_HALT)
     {
-      printLSQ(cpu);
-      printf("LSQ Stage");
+      cpu->stage[F].stalled = 1;
     }
   }
-  return 0;
-}
 
-int robstage(APEX_CPU *cpu)
-{
-  CPU_Stage *stage = &cpu->stage[ROB];
-  if (!stage->busy && !stage->stalled)
+  /* Dispatched instructions wait in the IQ latch for free entries, which
+   * they take in slot order
+   */
+  int waiting = 0;
+  int iq_held = 0;
+  for (int s = 0; s < width; ++s)
   {
-
-    get_ROB(cpu);
-    if (ENABLE_DEBUG_MESSAGES)
-    {
-      printROB(cpu);
-    }
+    CPU_Stage *iq_latch = &cpu->stage[front_latch(cpu, IQ, s)];
+    iq_latch->stalled =
+        !iq_latch->busy && cpu->iq_count + waiting >= cpu->config.iq_size;
+    waiting += !iq_latch->busy;
+    iq_held |= iq_latch->stalled;
   }
-  return 0;
-}
 
-int iqstage(APEX_CPU *cpu)
-{
-  CPU_Stage *stage = &cpu->stage[IQ];
-  if (!stage->busy && !stage->stalled)
+  /* Decode holds its group behind a HALT and while dispatch is held.
+   * Otherwise the slots dispatch in order, each counting the entries the
+   * slots before it take: a slot is held, with every slot after it, while
+   * the ROB or for memory instructions the LSQ is full, while no physical
+   * register is free for its destination or no tag for a branch, or when
+   * it follows a HALT
+   */
+  int cause = cpu->stage[F].stalled ? STALL_FRONTEND
+              : iq_held             ? STALL_IQ_FULL
+                                    : -1;
+  int rob_used = 0;
+  int lsq_used = 0;
+  int prf_used = 0;
+  int tags_used = __builtin_popcount(cpu->br_active);
+  int after_halt = 0;
+  for (int s = 0; s < width; ++s)
   {
-    get_I(cpu);
-
-    if (strcmp(stage->opcode, "MUL") == 0)
-    {
-      cpu->stage[MUL1] = cpu->stage[IQ];
-    }
-    else
+    CPU_Stage *stage = &cpu->stage[front_latch(cpu, DRF, s)];
+    if (stage->busy)
     {
-      cpu->stage[INT1] = cpu->stage[IQ];
+      stage->stalled = cause >= 0;
+      continue;
     }
 
-    if (ENABLE_DEBUG_MESSAGES)
+    int mem = apex_op_info[stage->op].fu == FU_MEM;
+    int writes_rd = apex_formats[apex_op_info[stage->op].format].writes_rd;
+    int branch = is_branch(stage->op);
+    if (cause < 0)
     {
-      printI(cpu);
-      // print_stage_content("IQ", stage);
+      if (after_halt)
+      {
+        cause = STALL_FRONTEND;
+      }
+      else if (cpu->rob_count + rob_used == cpu->config.rob_size)
+      {
+        cause = STALL_ROB_FULL;
+      }
+      else if (mem && cpu->lsq_count + lsq_used == cpu->config.lsq_size)
+      {
+        cause = STALL_LSQ_FULL;
+      }
+      else if (writes_rd && cpu->free_count == prf_used)
+      {
+        cause = STALL_PRF_FULL;
+      }
+      else if (branch && tags_used == cpu->config.branch_tags)
+      {
+        cause = STALL_BR_TAGS;
+      }
     }
+    stage->stalled = cause >= 0;
+
+    rob_used++;
+    lsq_used += mem;
+    prf_used += writes_rd;
+    tags_used += branch;
+    after_halt |= stage->op == OP_HALT;
   }
 
-  return 0;
+  if (cause >= 0)
+  {
+    cpu->stalls[cause]++;
+  }
 }
 
-int memfu1(APEX_CPU *cpu)
+/*
+ * Ends a cycle: the next bank becomes current and the old current bank is
+ * cleared to bubbles for the stages to fill. Stalled stages keep their
+ * latch
+ */
+static void
+commit_latches(APEX_CPU *cpu)
 {
-  CPU_Stage *stage = &cpu->stage[MEM1];
-  if (!stage->busy && !stage->stalled)
-  {
-
-    /* Store */
-    if (strcmp(stage->opcode, "STORE") == 0)
-    {
-      stage->mem_address = stage->rs2_value + stage->imm;
-    }
+  CPU_Stage *done = cpu->stage;
 
-    /* STR */
-    if (strcmp(stage->opcode, "STR") == 0)
-    {
-      stage->mem_address = stage->rs2_value + stage->rs3_value;
-    }
-
-    /* LDR */
-    if (strcmp(stage->opcode, "LDR") == 0)
-    {
-      stage->mem_address = stage->rs1_value + stage->rs2_value;
-    }
-
-    /* MOVC */
-    if (strcmp(stage->opcode, "LOAD") == 0)
+  for (int i = 0; i < cpu->num_stages; ++i)
+  {
+    if (done[i].stalled)
     {
-      stage->buffer = cpu->data_memory[stage->mem_address];
+      cpu->next[i] = done[i];
     }
+  }
+  cpu->stage = cpu->next;
+  cpu->next = done;
+  for (int i = 0; i < cpu->num_stages; ++i)
+  {
+    cpu->next[i].busy = 1;
+  }
+}
 
-    /* Copy data from decode latch to execute latch*/
-    cpu->stage[MEM2] = cpu->stage[MEM1];
+/* Front-end stage functions, indexed by stage. Every stage reads only the
+ * current latch bank and writes only the next one, so they can be
+ * evaluated in any order
+ */
+static int (*const stage_fns[NUM_FRONT_STAGES])(APEX_CPU *cpu) = {
+  [F] = fetch,
+  [DRF] = decode,
+  [IQ] = iqstage,
+  [LSQ] = lsqstage,
+  [ROB] = robstage,
+};
 
-    if (ENABLE_DEBUG_MESSAGES)
+/*
+ * Returns 1 once no stage holds an instruction and fetch has nothing left
+ * to fetch
+ */
+static int
+pipeline_drained(APEX_CPU *cpu)
+{
+  for (int i = DRF; i < cpu->num_stages; ++i)
+  {
+    if (!cpu->stage[i].busy)
     {
-      print_stage_content("Memory FU 1", stage);
+      return 0;
     }
   }
-  return 0;
+  if (cpu->iq_count > 0 || cpu->rob_count > 0)
+  {
+    return 0;
+  }
+  int index = get_code_index(cpu->pc);
+  return cpu->stage[F].stalled || index < 0 ||
+         index >= cpu->code_memory_size;
 }
 
-int memfu2(APEX_CPU *cpu)
+/*
+ * Returns 1 once the program has halted or run to completion
+ */
+int APEX_cpu_finished(APEX_CPU *cpu)
 {
-  CPU_Stage *stage = &cpu->stage[MEM2];
-  if (!stage->busy && !stage->stalled)
-  {
-
-    /* Copy data from decode latch to execute latch*/
-    cpu->stage[MEM3] = cpu->stage[MEM2];
+  return cpu->haltflag || pipeline_drained(cpu);
+}
 
-    if (ENABLE_DEBUG_MESSAGES)
+/*
+ * Simulates one clock cycle
+ */
+static void
+cycle(APEX_CPU *cpu)
+{
+  if (DEBUG_MESSAGES(cpu))
+  {
+    printf("--------------------------------\n");
+    printf("Clock Cycle #: %d\n", cpu->clock + 1);
+    printf("--------------------------------\n");
+  }
+  complete(cpu);
+  update_stalls(cpu);
+  for (int i = 0; i < NUM_FRONT_STAGES; ++i)
+  {
+    stage_fns[i](cpu);
+  }
+  for (int u = 0; u < cpu->num_units; ++u)
+  {
+    for (int k = 0; k < cpu->units[u].latency; ++k)
     {
-      print_stage_content("Memory FU 2", stage);
+      fustage(cpu, u, k);
     }
   }
-  return 0;
+  retire(cpu);
+  commit_latches(cpu);
+  cpu->clock++;
 }
 
-int memfu3(APEX_CPU *cpu)
+/*
+ * Returns the number of cycles until the earliest load sent back from a
+ * MEM unit can issue again, or INT_MAX if there is none
+ */
+static int
+next_fill(APEX_CPU *cpu)
 {
-  CPU_Stage *stage = &cpu->stage[MEM3];
-  if (!stage->busy && !stage->stalled)
+  int next = INT_MAX;
+  for (int n = 0; n < cpu->lsq_count; ++n)
   {
-    cpu->stage[RET] = cpu->stage[MEM3];
-    if (ENABLE_DEBUG_MESSAGES)
+    lsq *entry = &cpu->LSQ[(cpu->lsq_head + n) % cpu->config.lsq_size];
+    if (!entry->issued && entry->fill > cpu->clock &&
+        entry->fill - cpu->clock < next)
     {
-      print_stage_content("Memory FU 3", stage);
+      next = entry->fill - cpu->clock;
     }
   }
-  return 0;
+  return next;
 }
 
-int intfu1(APEX_CPU *cpu)
+/*
+ * Returns the cycles a blocking load in the last stage of MEM unit 'unit'
+ * still waits for the data cache, or 0 if there is no such load or an
+ * instruction behind it can still move up a stage
+ */
+static int
+mem_waiting(APEX_CPU *cpu, APEX_Unit *unit)
 {
-
-  CPU_Stage *stage;
-  //if (!stage->busy && !stage->stalled)
-  //{
-
-  /* Store */
-  if (strcmp(stage->opcode, "STORE") == 0)
-  {
-    stage->mem_address = stage->rs2_value + stage->imm;
-  }
-
-  /* STR */
-  if (strcmp(stage->opcode, "STR") == 0)
+  CPU_Stage *stages = &cpu->stage[unit->first_stage];
+  CPU_Stage *last = &stages[unit->latency - 1];
+  if (last->busy || !last->accessed || last->mem_wait == 0)
   {
-    stage->mem_address = stage->rs2_value + stage->rs3_value;
+    return 0;
   }
-
-  /* LOAD */
-  if (strcmp(stage->opcode, "LOAD") == 0)
+  int k = unit->latency - 2;
+  while (k >= 0 && !stages[k].busy)
   {
-    stage->mem_address = stage->rs1_value + stage->imm;
+    k--;
   }
-
-  /* LDR */
-  if (strcmp(stage->opcode, "LDR") == 0)
+  for (; k >= 0; --k)
   {
-    stage->mem_address = stage->rs1_value + stage->rs2_value;
+    if (!stages[k].busy)
+    {
+      return 0;
+    }
   }
+  return last->mem_wait;
+}
 
-  /* MOVC */
-  if (strcmp(stage->opcode, "MOVC") == 0)
+/*
+ * Returns 1 if any unit executing memory instructions can take a load
+ * from the LSQ in the next cycle
+ */
+static int
+mem_unit_free(APEX_CPU *cpu)
+{
+  for (int u = 0; u < cpu->num_units; ++u)
   {
-    stage->buffer = stage->imm + 0;
+    APEX_Unit *unit = &cpu->units[u];
+    if ((unit->accepts & (1 << FU_MEM)) && unit_free(cpu, unit))
+    {
+      return 1;
+    }
   }
+  return 0;
+}
 
-  /* ADD */
-  if (strcmp(stage->opcode, "ADD") == 0)
+/*
+ * Returns the number of cycles, up to 'limit', until any stage can do
+ * something other than move an instruction one stage down a functional
+ * unit: 1 while the front end or a retire latch holds an instruction,
+ * fetch can fetch, an IQ entry can issue, a load can issue to a free MEM
+ * unit or the ROB can commit, else the distance of the most advanced
+ * instruction from the last stage of its unit, the cycles a blocking load
+ * has left to wait for the data cache or those of a load waiting for an
+ * MSHR
+ */
+static int
+quiet_cycles(APEX_CPU *cpu, int limit)
+{
+  CPU_Stage *fetch_stage = &cpu->stage[F];
+  int index = get_code_index(cpu->pc);
+  if (!fetch_stage->busy && !fetch_stage->stalled &&
+      !front_stalled(cpu, DRF) && !cpu->draining && index >= 0 &&
+      index < cpu->code_memory_size)
   {
-    stage->buffer = stage->rs1_value + stage->rs2_value;
+    return 1;
   }
-
-  /* SUB */
-  if (strcmp(stage->opcode, "SUB") == 0)
+  for (int i = DRF; i < front_latch(cpu, NUM_FRONT_STAGES, 0); ++i)
   {
-    stage->buffer = stage->rs1_value - stage->rs2_value;
+    if (!cpu->stage[i].busy)
+    {
+      return 1;
+    }
   }
-
-  /* AND */
-  if (strcmp(stage->opcode, "AND") == 0)
+  for (int fu = 0; fu < NUM_FU_CLASSES; ++fu)
   {
-    stage->buffer = stage->rs1_value & stage->rs2_value;
+    if (bits_any(cpu->iq_ready[fu], cpu->iq_words))
+    {
+      return 1;
+    }
   }
-
-  /* OR */
-  if (strcmp(stage->opcode, "OR") == 0)
+  if (cpu->rob_count > 0 && cpu->ROB[cpu->rob_head].done)
   {
-    stage->buffer = stage->rs1_value | stage->rs2_value;
+    return 1;
   }
-
-  /* EX-OR */
-  if (strcmp(stage->opcode, "EX-OR") == 0)
+  int from;
+  if (select_load(cpu, &from) >= 0 && mem_unit_free(cpu))
   {
-    stage->buffer = stage->rs1_value ^ stage->rs2_value;
+    return 1;
   }
 
-  cpu->stage[INT2] = cpu->stage[INT1];
-  //printf("at Int1-----");
-  if (ENABLE_DEBUG_MESSAGES)
+  int quiet = limit;
+  int occupied = 0;
+  int fill = next_fill(cpu);
+  if (fill < quiet)
   {
-    print_stage_content("Int FU 1", stage);
+    quiet = fill;
+    occupied = 1;
   }
-  //}
-  return 0;
-}
-
-int intfu2(APEX_CPU *cpu)
-{
-  CPU_Stage *stage = &cpu->stage[INT2];
-  if (!stage->busy && !stage->stalled)
+  for (int u = 0; u < cpu->num_units && quiet > 1; ++u)
   {
-    cpu->stage[RET] = cpu->stage[INT2];
-
-    if (strcmp(stage->opcode, "MOVC") == 0 ||
-        strcmp(stage->opcode, "AND") == 0 ||
-        strcmp(stage->opcode, "OR") == 0 ||
-        strcmp(stage->opcode, "EX-OR") == 0 ||
-        strcmp(stage->opcode, "ADD") == 0 ||
-        strcmp(stage->opcode, "ADDL") == 0 ||
-        strcmp(stage->opcode, "SUB") == 0 ||
-        strcmp(stage->opcode, "SUBL") == 0)
+    APEX_Unit *unit = &cpu->units[u];
+    if (!cpu->stage[unit->ret_stage].busy)
+    {
+      return 1;
+    }
+    int wait = mem_waiting(cpu, unit);
+    if (wait > 0)
     {
-      cpu->regs[stage->rd] = stage->buffer;
-      cpu->regs_valid[stage->rd] = 1;
+      if (wait < quiet)
+      {
+        quiet = wait;
+      }
+      occupied = 1;
+      continue;
     }
-    if (ENABLE_DEBUG_MESSAGES)
+    for (int k = unit->latency - 1; k >= 0; --k)
     {
-      print_stage_content("Int FU 2", stage);
+      if (!cpu->stage[unit->first_stage + k].busy)
+      {
+        if (unit->latency - 1 - k < quiet)
+        {
+          quiet = unit->latency - 1 - k;
+        }
+        occupied = 1;
+        break;
+      }
     }
   }
-  return 0;
+  return !occupied || quiet < 1 ? 1 : quiet;
 }
 
-int mulfu1(APEX_CPU *cpu)
+/*
+ * Advances the clock by 'n' cycles in which instructions only move down
+ * their units, as found by quiet_cycles(), by shifting every unit's
+ * latches n stages at once. A unit held by a blocking load counts down
+ * the load's wait instead
+ */
+static void
+skip_cycles(APEX_CPU *cpu, int n)
 {
-  CPU_Stage *stage = &cpu->stage[MUL1];
-  if (!stage->busy && !stage->stalled)
+  for (int u = 0; u < cpu->num_units; ++u)
   {
-    cpu->stage[MUL2] = cpu->stage[MUL1];
-
-    if (ENABLE_DEBUG_MESSAGES)
+    APEX_Unit *unit = &cpu->units[u];
+    CPU_Stage *stages = &cpu->stage[unit->first_stage];
+    if (mem_waiting(cpu, unit) > 0)
+    {
+      stages[unit->latency - 1].mem_wait -= n;
+      continue;
+    }
+    for (int k = unit->latency - 1; k >= 0; --k)
     {
-      print_stage_content("MUL FU 1", stage);
+      if (k >= n)
+      {
+        stages[k] = stages[k - n];
+      }
+      else
+      {
+        stages[k].busy = 1;
+      }
     }
   }
-  return 0;
-}
 
-int mulfu2(APEX_CPU *cpu)
-{
-  CPU_Stage *stage = &cpu->stage[MUL2];
-  if (!stage->busy && !stage->stalled)
+  if (cpu->stage[F].stalled || front_stalled(cpu, DRF))
   {
-
-    cpu->stage[MUL3] = cpu->stage[MUL2];
-
-    if (ENABLE_DEBUG_MESSAGES)
-    {
-      print_stage_content("MUL FU 2", stage);
-    }
+    cpu->stalls[STALL_FRONTEND] += n;
   }
-  return 0;
+  cpu->clock += n;
 }
 
-int mulfu3(APEX_CPU *cpu)
+/*
+ * Simulates up to 'cycles' more cycles, or until the program finishes if
+ * 'cycles' is 0. Returns the number of cycles simulated
+ *
+ * Note : Stretches where the front end is idle and instructions are only
+ * travelling down MUL or MEM pipelines or waiting on the data cache are
+ * skipped in one step, giving the same state and cycle count as simulating
+ * them one by one. Display mode simulates every cycle to print it
+ */
+int APEX_cpu_simulate(APEX_CPU *cpu, int cycles)
 {
-  CPU_Stage *stage = &cpu->stage[MUL3];
-  if (!stage->busy && !stage->stalled)
+  int start = cpu->clock;
+
+  while (!APEX_cpu_finished(cpu) &&
+         (cycles <= 0 || cpu->clock - start < cycles))
   {
-    cpu->stage[RET] = cpu->stage[MUL3];
-    if (ENABLE_DEBUG_MESSAGES)
+    if (!DEBUG_MESSAGES(cpu))
     {
-      print_stage_content("MUL FU 3", stage);
+      int limit = cycles > 0 ? cycles - (cpu->clock - start) : INT_MAX;
+      int quiet = quiet_cycles(cpu, limit);
+      if (quiet > 1)
+      {
+        skip_cycles(cpu, quiet);
+        continue;
+      }
     }
+    cycle(cpu);
   }
-  return 0;
+  return cpu->clock - start;
 }
 
-int retire(APEX_CPU *cpu)
+/*
+ * Returns 1 if any latch or queue holds an instruction, in which case the
+ * architectural state is not precise
+ */
+static int
+pipeline_busy(APEX_CPU *cpu)
 {
-  CPU_Stage *stage = &cpu->stage[RET];
-  if (!stage->busy && !stage->stalled)
+  for (int i = 0; i < cpu->num_stages; ++i)
   {
-
-    if (ENABLE_DEBUG_MESSAGES)
+    if (!cpu->stage[i].busy && i != F)
     {
-      print_stage_content("RET", stage);
+      return 1;
     }
   }
-  return 0;
+  return cpu->iq_count > 0 || cpu->rob_count > 0 || cpu->stage[F].stalled;
 }
 
-int display(APEX_CPU *cpu)
+/*
+ * Stops fetching and simulates until every instruction in flight has
+ * completed, so that the architectural state is precise again. Returns
+ * the number of cycles simulated
+ */
+int APEX_cpu_drain(APEX_CPU *cpu)
 {
-  printf("\n");
-    printf("==================REGISTER VALUE==============");
-    for (int i = 0; i < 16; i++)
-    {
-      printf("\n");
-      printf(" | Register[%d] | Value=%d | status=%s |", i, cpu->regs[i], (cpu->regs_valid[i]) ? "Valid" : "Invalid");
-    }
+  int start = cpu->clock;
 
-    printf("\n");
-    printf("==================DATA MEMORY ==============");
-    printf("\n");
-    for (int i = 0; i < 99; i++)
-    {
-      printf(" | MEM[%d] | Value=%d | \n", i, cpu->data_memory[i]);
-    }
+  cpu->draining = 1;
+  while (pipeline_busy(cpu) && !APEX_cpu_finished(cpu))
+  {
+    cycle(cpu);
+  }
+  cpu->draining = 0;
+  return cpu->clock - start;
 }
+
 /*
- *  APEX CPU simulation loop
+ * Functional (ISA level) execution: instructions update the registers,
+ * flags, data memory and pc directly, without stage latches or timing.
+ * Stops before the HALT, before 'stop_pc' (if not negative), after
+ * 'max_instructions' (if not 0), at the end of code memory or at a load
+ * or store outside data memory, which ends the run, leaving the
+ * state warmed up for the detailed pipeline to continue from cpu->pc.
+ * Returns the number of instructions executed, or -1 if the pipeline
+ * already holds instructions
  *
- *  Note : You are free to edit this function according to your
- * 				 implementation
+ * Note : The results come from the same exec functions the functional
+ * units use
  */
-int APEX_cpu_run(APEX_CPU *cpu, const char *function, const char *totalcycles)
+long
+APEX_cpu_fast_forward(APEX_CPU *cpu, long max_instructions, int stop_pc)
 {
-  while (cpu->clock <= cpu->code_memory_size)
+  if (pipeline_busy(cpu))
   {
+    return -1;
+  }
 
-    if (strcmp(function, "display") == 0)
+  long count = 0;
+  while (max_instructions <= 0 || count < max_instructions)
+  {
+    int index = get_code_index(cpu->pc);
+    if (index < 0 || index >= cpu->code_memory_size ||
+        cpu->pc == stop_pc)
     {
-      ENABLE_DEBUG_MESSAGES;
+      break;
     }
-    int totalcyclecount = atoi(totalcycles);
 
-    /* All the instructions committed, so exit */
-    if (cpu->ins_completed == cpu->code_memory_size)
+    const APEX_Instruction *ins = &cpu->code_memory[index];
+    if (ins->op == OP_HALT)
     {
-      printf("(apex) >> Simulation Complete");
       break;
     }
 
-    if (ENABLE_DEBUG_MESSAGES)
+    CPU_Stage stage = {
+      .pc = cpu->pc,
+      .imm = ins->imm,
+      .rs1_value = cpu->regs[ins->rs1],
+      .rs2_value = cpu->regs[ins->rs2],
+      .rs3_value = cpu->regs[ins->rs3],
+      .op = ins->op,
+    };
+    int next_pc = cpu->pc + 4;
+
+    switch (ins->op)
+    {
+    case OP_LOAD:
+    case OP_LDR:
+      int_ops[ins->op](cpu, &stage);
+      if (!mem_fault(cpu, cpu->pc, stage.mem_address))
+      {
+        mem_ops[ins->op](cpu, &stage);
+        cpu->regs[ins->rd] = stage.buffer;
+      }
+      break;
+    case OP_STORE:
+    case OP_STR:
+      int_ops[ins->op](cpu, &stage);
+      if (!mem_fault(cpu, cpu->pc, stage.mem_address))
+      {
+        apex_memory_write(cpu, stage.mem_address, stage.rs1_value);
+      }
+      break;
+    case OP_BZ:
+    case OP_BNZ:
+      stage.rs1_value = !cpu->z_flag;
+      int_ops[ins->op](cpu, &stage);
+      next_pc = stage.buffer;
+      break;
+    case OP_JUMP:
+      int_ops[ins->op](cpu, &stage);
+      next_pc = stage.buffer;
+      break;
+    default:
+      fu_ops[apex_op_info[ins->op].fu][ins->op](cpu, &stage);
+      cpu->regs[ins->rd] = stage.buffer;
+      if (sets_zero_flag(ins->op))
+      {
+        cpu->z_flag = stage.buffer == 0;
+      }
+      break;
+    }
+    if (cpu->faulted)
     {
-      printf("--------------------------------\n");
-      printf("Clock Cycle #: %d\n", cpu->clock + 1);
-      printf("--------------------------------\n");
+      break;
     }
-    retire(cpu);
-    memfu3(cpu);
-    memfu2(cpu);
-    memfu1(cpu);
 
-    mulfu3(cpu);
-    mulfu2(cpu);
-    mulfu1(cpu);
-    intfu2(cpu);
-
-    intfu1(cpu);
-
-    robstage(cpu);
+    cpu->pc = next_pc;
+    count++;
+  }
 
-    iqstage(cpu);
-    lsqstage(cpu);
+  /* The renamed pipeline reads the architectural registers through the
+   * committed mapping
+   */
+  for (int i = 0; i < NUM_ARCH_REGS; ++i)
+  {
+    cpu->prf[cpu->arch_map[i]] = cpu->regs[i];
+  }
+  cpu->ins_fast_forwarded += count;
+  return count;
+}
 
-    decode(cpu);
-    fetch(cpu);
-    cpu->clock++;
+/*
+ *  APEX CPU simulation loop
+ *
+ *  'function' is "display" to dump every stage in every cycle, or
+ *  "simulate" to run quietly; both print the final state. Returns -1 if
+ *  the run stopped at a load or store outside data memory
+ *
+ *  Note : You are free to edit this function according to your
+ * 				 implementation
+ */
+int APEX_cpu_run(APEX_CPU *cpu, const char *function, const char *totalcycles)
+{
+  cpu->debug = strcmp(function, "display") == 0;
+  if (DEBUG_MESSAGES(cpu))
+  {
+    print_code_memory(cpu);
+  }
 
-    if (totalcyclecount == cpu->clock)
-    {
-      break;
-    }
+  APEX_cpu_simulate(cpu, atoi(totalcycles));
 
-    if (cpu->haltflag == 1)
-    {
-      break;
-    }
+  /* All the instructions committed, so exit */
+  if (cpu->faulted)
+  {
+    printf("(apex) >> Simulation Stopped at pc(%d): data memory word %d "
+           "is out of range",
+           cpu->fault_pc, cpu->fault_address);
+  }
+  else if (APEX_cpu_finished(cpu))
+  {
+    printf("(apex) >> Simulation Complete");
   }
   display(cpu);
+  apex_bpred_report(cpu);
+  apex_cache_report(cpu);
+  apex_prefetch_report(cpu);
   //display_reg_file(cpu);
-  return 0;
-}
\ No newline at end of file
+  return cpu->faulted ? -1 : 0;
+}
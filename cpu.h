@@ -8,7 +8,13 @@
  *  
  *  State University of New York, Binghamton
  */
+#include <stddef.h>
+#include <stdint.h>
 
+/* Front-end stages; the stages of every functional unit and the retire
+ * latches follow them in the latch array. Fetch has one latch, and every
+ * later front-end stage one per slot of the fetch group (fetch_width)
+ */
 enum
 {
   F,
@@ -16,107 +22,519 @@ enum
   IQ,
   LSQ,
   ROB,
-  MEM1,
-  MEM2,
-  MEM3,
-  INT1,
-  INT2,
-  MUL1,
-  MUL2,
-  MUL3,
-  RET,
-  NUM_STAGES
+  NUM_FRONT_STAGES
+};
+
+/* Number of architectural registers */
+#define NUM_ARCH_REGS 32
+
+/* Most branches in flight, each holding a tag of a 32-bit branch mask */
+#define APEX_MAX_BRANCH_TAGS 32
+
+/* Word of a bitset over queue entries or register tags */
+typedef uint64_t APEX_Bits;
+
+#define APEX_BITS_PER_WORD 64
+#define APEX_BITS_WORDS(n) (((n) + APEX_BITS_PER_WORD - 1) / APEX_BITS_PER_WORD)
+
+/* Opcode classes, decoded once by the file parser */
+enum
+{
+  OP_EMPTY,
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_AND,
+  OP_OR,
+  OP_EXOR,
+  OP_ADDL,
+  OP_SUBL,
+  OP_MOVC,
+  OP_LOAD,
+  OP_LDR,
+  OP_STORE,
+  OP_STR,
+  OP_BZ,
+  OP_BNZ,
+  OP_JUMP,
+  OP_HALT,
+  NUM_OPCODES
+};
+
+/* Operand kinds, in the order they appear in the assembly text */
+enum
+{
+  OPND_RD,
+  OPND_RS1,
+  OPND_RS2,
+  OPND_RS3,
+  OPND_IMM
+};
+
+/* Operand formats */
+enum
+{
+  FMT_NONE,        // HALT
+  FMT_RD_IMM,      // MOVC,Rd,#imm
+  FMT_RD_RS1_RS2,  // ADD,Rd,Rs1,Rs2
+  FMT_RD_RS1_IMM,  // ADDL,Rd,Rs1,#imm
+  FMT_RS1_RS2_IMM, // STORE,Rs1,Rs2,#imm
+  FMT_RS1_RS2_RS3, // STR,Rs1,Rs2,Rs3
+  FMT_IMM,         // BZ,#imm
+  FMT_RS1_IMM,     // JUMP,Rs1,#imm
+  NUM_FORMATS
+};
+
+/* Functional unit classes */
+enum
+{
+  FU_NONE,
+  FU_INT,
+  FU_MUL,
+  FU_MEM,
+  NUM_FU_CLASSES
+};
+
+/* Direction predictors for BZ and BNZ */
+enum
+{
+  BPRED_STATIC,  // Backward taken, forward not taken
+  BPRED_BIMODAL, // 2-bit counters indexed by pc
+  BPRED_GSHARE,  // 2-bit counters indexed by pc xor global history
+  NUM_BPREDS
+};
+
+/* Arbitration of the result bus when more results are ready than it has
+ * slots
+ */
+enum
+{
+  CDB_FIXED,       // Units in retire priority order: INT, MUL, MEM
+  CDB_OLDEST,      // Oldest instruction first
+  CDB_ROUND_ROBIN, // Units in turn, starting after the last one granted
+  NUM_CDB_POLICIES
+};
+
+/* Replacement policies of a data cache level */
+enum
+{
+  CACHE_LRU,    // Least recently used line
+  CACHE_FIFO,   // Line filled first
+  CACHE_RANDOM, // Any line
+  NUM_CACHE_POLICIES
+};
+
+/* Hardware prefetchers filling the L1D ahead of loads and stores */
+enum
+{
+  PREFETCH_NONE,
+  PREFETCH_NEXT_LINE, // The lines after every line accessed
+  PREFETCH_STRIDE,    // Per pc, addresses a repeating stride ahead
+  PREFETCH_STREAM,    // Lines ahead of runs of consecutive lines
+  NUM_PREFETCHERS
+};
+
+/* Data memory pages of 4 KB, and pages mapped by a page table */
+#define APEX_PAGE_WORDS 1024
+#define APEX_TABLE_PAGES 1024
+
+/* Levels of the data cache hierarchy: L1D and an optional L2 */
+#define APEX_CACHE_LEVELS 2
+
+/* Causes of lost dispatch or fetch cycles, counted by the pipeline */
+enum
+{
+  STALL_FRONTEND, // Fetch and decode held, e.g. behind a HALT
+  STALL_PRF_FULL, // No free physical register for a destination
+  STALL_IQ_FULL,  // No free IQ entry for a dispatched instruction
+  STALL_LSQ_FULL, // No free LSQ entry for a dispatched instruction
+  STALL_ROB_FULL, // No free ROB entry for a dispatched instruction
+  STALL_BR_TAGS,  // No free branch tag for a dispatched branch
+  NUM_STALLS
 };
 
-/* Format of an APEX instruction  */
+extern const char *const apex_stall_names[NUM_STALLS];
+
+/* Operand layout of an instruction format */
+typedef struct APEX_Format
+{
+  int num_operands; // Number of operands after the opcode
+  int operands[3];  // OPND_* kinds, in assembly order
+  int reads;        // Bitmask of (1 << OPND_RSx) source registers read
+  int writes_rd;    // Flag to indicate, format writes Rd
+} APEX_Format;
+
+/* Static metadata of an opcode */
+typedef struct APEX_OpInfo
+{
+  const char *name; // Assembly mnemonic
+  int format;       // FMT_* operand format
+  int fu;           // FU_* functional unit class
+} APEX_OpInfo;
+
+extern const APEX_OpInfo apex_op_info[NUM_OPCODES];
+extern const APEX_Format apex_formats[NUM_FORMATS];
+
+/* Format of an APEX instruction
+ *
+ * Note : All latches and queue entries keep the decoded opcode and narrow
+ * register fields; the mnemonic is recovered from apex_op_info only when
+ * printing
+ */
 typedef struct APEX_Instruction
 {
-  char opcode[128]; // Operation Code
-  int rd;           // Destination Register Address
-  int rs1;          // Source-1 Register Address
-  int rs2;          // Source-2 Register Address
-  int rs3;          // Source-3 Regsiter Address
-  int imm;          // Literal Value
+  int32_t imm;      // Literal Value
+  uint8_t op;       // Decoded OP_* opcode class
+  uint8_t rd;       // Destination Register Address
+  uint8_t rs1;      // Source-1 Register Address
+  uint8_t rs2;      // Source-2 Register Address
+  uint8_t rs3;      // Source-3 Regsiter Address
 } APEX_Instruction;
 
+/* Header of a pre-assembled program image, followed by num_instructions
+ * APEX_Instruction records
+ */
+#define APEX_IMAGE_VERSION 1
+
+typedef struct APEX_ImageHeader
+{
+  char magic[4];             // "APXI"
+  uint16_t version;          // APEX_IMAGE_VERSION
+  uint16_t record_size;      // sizeof(APEX_Instruction) of the writer
+  uint32_t num_instructions; // Number of instruction records
+  uint32_t reserved;
+} APEX_ImageHeader;
+
+/* Header of a sparse data memory image, followed by runs of words up to
+ * the end of the file: an APEX_DataRun, then its 'words' words
+ */
+#define APEX_DATA_VERSION 1
+
+typedef struct APEX_DataHeader
+{
+  char magic[4];    // "APXD"
+  uint16_t version; // APEX_DATA_VERSION
+  uint16_t reserved;
+} APEX_DataHeader;
+
+typedef struct APEX_DataRun
+{
+  uint32_t address; // Data memory word of the first word
+  uint32_t words;
+} APEX_DataRun;
+
 /* Model of CPU stage latch */
 typedef struct CPU_Stage
 {
-  int pc;           // Program Counter
-  char opcode[128]; // Operation Code
-  int rs1;          // Source-1 Register Address
-  int rs2;          // Source-2 Register Address
-  int rs3;          // Source-3 Regsiter Address
-  int rd;           // Destination Register Address
-  int imm;          // Literal Value
-  int rs1_value;    // Source-1 Register Value
-  int rs2_value;    // Source-2 Register Value
-  int rs3_value;    // Source-3 Register Value
-  int buffer;       // Latch to hold some value
-  int mem_address;  // Computed Memory Address
-  int busy;         // Flag to indicate, stage is performing some action
-  int stalled;      // Flag to indicate, stage is stalled
+  int32_t pc;          // Program Counter
+  int32_t pred_pc;     // Predicted pc of the next instruction
+  uint32_t ghr;        // Global history the branch was predicted with
+  int32_t imm;         // Literal Value
+  int32_t rs1_value;   // Source-1 Register Value
+  int32_t rs2_value;   // Source-2 Register Value
+  int32_t rs3_value;   // Source-3 Register Value
+  int32_t buffer;      // Latch to hold some value
+  int32_t mem_address; // Computed Memory Address
+  uint8_t op;          // Decoded OP_* opcode class
+  uint8_t rs1;         // Source-1 Register Address
+  uint8_t rs2;         // Source-2 Register Address
+  uint8_t rs3;         // Source-3 Regsiter Address
+  uint8_t rd;          // Destination Register Address
+  uint8_t pending;     // Sources (1 << OPND_RSx) awaiting their value
+  uint8_t prd;         // Physical register renaming Rd
+  uint8_t prs1;        // Physical register read for Rs1
+  uint8_t prs2;        // Physical register read for Rs2
+  uint8_t prs3;        // Physical register read for Rs3
+  uint16_t rob;        // ROB entry of the instruction
+  uint16_t lsq;        // LSQ entry of a memory instruction
+  uint32_t br_mask;    // Tags of the older branches still unresolved
+  uint8_t br_tag;      // Tag of a branch
+  uint16_t mem_wait;   // Cycles a load still waits for the data cache
+  uint8_t busy : 1;    // Flag to indicate, stage is performing some action
+  uint8_t stalled : 1; // Flag to indicate, stage is stalled
+  uint8_t forwarded : 1; // Flag to indicate, a load's value came from a store
+  uint8_t accessed : 1;  // Flag to indicate, a load has accessed the cache
+  uint8_t ghr_shifted : 1; // Flag to indicate, fetch shifted the history
 } CPU_Stage;
 
-struct LSQ_Entry
-{
-  int memory_address;
-  char opcode[128];
-  int pc; // Program counter
-  int rs1;
-  int rs2;
-  int rs3;
-  int rd;
-  int imm;
-  int rs1_value;
-} LSQ_Entry;
-
 typedef struct l1
 {
-  int pc;
-  char opcode[128];
-  int rd;
-  int rs1;
-  int rs2;
-  int rs3;
-  int imm;
+  int32_t pc;
+  int32_t imm;
+  uint8_t op;
+  uint8_t rd;
+  uint8_t rs1;
+  uint8_t rs2;
+  uint8_t rs3;
 } l1;
 
+/* Issue queue entry: sources are captured at dispatch, or when their
+ * producer broadcasts the result while the entry waits. The branches it
+ * depends on are kept in the per-tag bitsets iq_branch
+ */
 typedef struct iq
 {
-  int pc;
-  char opcode[128];
-  int rd;
-  int rs1;
-  int rs2;
-  int rs3;
-  int imm;
-  int get_data;
+  int32_t pc;
+  int32_t pred_pc;
+  uint32_t ghr;
+  int32_t imm;
+  int32_t rs1_value;
+  int32_t rs2_value;
+  int32_t rs3_value;
+  uint32_t seq;    // Dispatch order, for oldest-first select
+  uint16_t rob;    // ROB entry of the instruction
+  uint16_t lsq;    // LSQ entry of a memory instruction
+  uint8_t br_tag;  // Tag of a branch
+  uint8_t op;
+  uint8_t rd;
+  uint8_t rs1;
+  uint8_t rs2;
+  uint8_t rs3;
+  uint8_t pending; // Sources (1 << OPND_RSx) awaiting their value
+  uint8_t prd;     // Physical registers of Rd and the sources
+  uint8_t prs1;
+  uint8_t prs2;
+  uint8_t prs3;
 } iq;
 
+/* Reorder buffer entry, allocated at dispatch and committed in program
+ * order once done
+ */
 typedef struct rob
 {
-  int pc;
-  char opcode[128];
-  int rd;
-  int rs1;
-  int rs2;
-  int imm;
-  int get_data;
-}rob;
-
+  int32_t pc;
+  int32_t imm;
+  int32_t target;       // Resolved pc after a branch
+  uint32_t ghr;         // Global history a branch was predicted with
+  uint8_t op;
+  uint8_t rd;
+  uint8_t rs1;
+  uint8_t rs2;
+  uint8_t prd;      // Physical register renaming Rd
+  uint8_t prev_prd; // Previous mapping of Rd, freed at commit
+  uint8_t taken;        // Flag to indicate, the branch was taken
+  uint8_t mispredicted; // Flag to indicate, the branch was mispredicted
+  uint8_t done;         // Flag to indicate, the instruction has completed
+} rob;
+
+/* Load/store queue entry, in program order. The address arrives from the
+ * INT unit and a store's data from the result bus, if it was not ready at
+ * dispatch; stores write memory when they commit
+ */
 typedef struct lsq
 {
-  int pc;
-  char opcode[128];
-  int rd;
-  int rs1;
-  int rs2;
-  int rs3;
-  int imm;
-  int get_data;
+  int32_t pc;
+  int32_t imm;
+  int32_t mem_address; // Computed Memory Address
+  int32_t data;        // Value to store
+  uint16_t rob;        // ROB entry of the instruction
+  uint8_t op;
+  uint8_t rd;
+  uint8_t rs1;
+  uint8_t rs2;
+  uint8_t rs3;
+  uint8_t prd;         // Physical register renaming a load's Rd
+  uint8_t data_tag;    // Physical register a store's data comes from
+  uint8_t addr_valid;  // Flag to indicate, mem_address is known
+  uint8_t data_valid;  // Flag to indicate, a store's data is known
+  uint8_t issued;      // Flag to indicate, the load went to a MEM unit
+  uint8_t missed;      // Flag to indicate, the load waits for an MSHR fill
+  int32_t fill;        // Cycle the load can go to a MEM unit again
 } lsq;
 
+/* Microarchitecture parameters, fixed when an APEX cpu is created */
+typedef struct APEX_Config
+{
+  int iq_size;          // Issue queue entries
+  int lsq_size;         // Load/store queue entries
+  int rob_size;         // Reorder buffer entries
+  int prf_size;         // Physical registers
+  int fetch_width;      // Instructions fetched and dispatched per cycle
+  int commit_width;     // ROB entries committed per cycle
+  int bpred;            // BPRED_* direction predictor
+  int bpred_bits;       // Log2 of the counters, and global history bits
+  int btb_size;         // Branch target buffer entries
+  int branch_tags;      // Branches in flight
+  int cdb_width;        // Results broadcast per cycle
+  int cdb_policy;       // CDB_* arbitration policy
+  int int_units;        // Number of integer units
+  int int_latency;      // Stages of an integer unit
+  int int_pipelined;    // Flag to indicate, integer units are pipelined
+  int mul_units;        // Number of multiply units
+  int mul_latency;      // Stages of a multiply unit
+  int mul_pipelined;    // Flag to indicate, multiply units are pipelined
+  int mem_units;        // Number of memory units
+  int mem_latency;      // Stages of a memory unit
+  int mem_pipelined;    // Flag to indicate, memory units are pipelined
+  int l1d_size;         // L1 data cache words, 0 for none
+  int l1d_assoc;        // Ways of a set
+  int l1d_line;         // Words of a line
+  int l1d_policy;       // CACHE_* replacement policy
+  int l1d_latency;      // Cycles of a hit
+  int l2_size;          // L2 cache words, 0 for none
+  int l2_assoc;
+  int l2_line;
+  int l2_policy;
+  int l2_latency;
+  int memory_latency;   // Cycles of an access missing every cache level
+  int mshrs;            // Misses outstanding at once, 0 for blocking
+  int prefetcher;       // PREFETCH_* prefetcher
+  int prefetch_degree;  // Lines prefetched ahead per access
+  int prefetch_table;   // Entries of the stride or stream table
+  int data_memory_size; // Data memory words
+} APEX_Config;
+
+/* Header of a cpu checkpoint, followed by the saved state blocks and
+ * data_pages pages of data memory, each a uint32_t page number and
+ * APEX_PAGE_WORDS words
+ */
+#define APEX_CHECKPOINT_VERSION 4
+
+typedef struct APEX_CheckpointHeader
+{
+  char magic[4];             // "APXC"
+  uint16_t version;          // APEX_CHECKPOINT_VERSION
+  uint16_t bank;             // Latch bank holding the current stages
+  APEX_Config config;        // Parameters of the saved cpu
+  uint32_t code_memory_size; // Instructions in the saved program
+  uint32_t data_pages;       // Data memory pages stored
+  uint64_t code_hash;        // Hash of the saved program
+} APEX_CheckpointHeader;
+
+/* Result of a sampled simulation: per-window IPC and stall fractions,
+ * as means with the half width of their 95% confidence interval (-1 when
+ * there are too few windows)
+ */
+typedef struct APEX_SampleStats
+{
+  int samples;                    // Measured windows
+  long instructions;              // Instructions executed in any mode
+  long detailed_cycles;           // Cycles simulated by the pipeline
+  long measured_cycles;           // Cycles within measured windows
+  double ipc;                     // Mean IPC of the windows
+  double ipc_ci;                  // 95% confidence half width of ipc
+  double stall[NUM_STALLS];       // Mean fraction of stalled cycles
+  double stall_ci[NUM_STALLS];    // 95% confidence half width of stall
+} APEX_SampleStats;
+
+/* State saved when a branch is dispatched, and restored in one step if
+ * it mispredicts
+ */
+typedef struct APEX_Snapshot
+{
+  uint8_t rename_table[NUM_ARCH_REGS];
+  uint32_t br_mask; // Tags of the older branches
+  int z_rob;
+  uint8_t ghr_shifted; // Flag to indicate, the branch shifted the history
+} APEX_Snapshot;
+
+/* Branch target buffer entry, direct mapped by pc */
+typedef struct APEX_BTBEntry
+{
+  int32_t pc;     // Branch address, -1 when empty
+  int32_t target; // Target the branch was last taken to
+} APEX_BTBEntry;
+
+/* Committed outcomes of a static branch */
+typedef struct APEX_BranchStats
+{
+  long executed;
+  long taken;
+  long mispredicted;
+} APEX_BranchStats;
+
+/* Tag state of a cache line. The cache only models timing: the data
+ * itself stays in data memory
+ */
+typedef struct APEX_CacheLine
+{
+  int32_t tag;    // Line address, -1 when invalid
+  uint32_t stamp; // Access (LRU) or fill (FIFO) order
+  uint8_t dirty;  // Flag to indicate, a store wrote the line
+  uint8_t prefetched; // Flag to indicate, an unused prefetch filled it
+} APEX_CacheLine;
+
+typedef struct APEX_CacheStats
+{
+  long hits;
+  long misses;
+  long evictions;
+  long writebacks; // Dirty lines evicted
+} APEX_CacheStats;
+
+/* A level of the data cache hierarchy, set associative */
+typedef struct APEX_Cache
+{
+  const char *name;
+  int sets;
+  int assoc;
+  int line;    // Words of a line
+  int policy;  // CACHE_* replacement policy
+  int latency; // Cycles of a hit
+  APEX_CacheLine *lines; // sets * assoc lines, set by set
+  APEX_CacheStats stats;
+} APEX_Cache;
+
+/* Miss status holding register: a line of the first cache level being
+ * filled
+ */
+typedef struct APEX_Mshr
+{
+  int32_t line;  // Line address
+  int32_t ready; // Cycle the fill reaches a load; free from then on
+  uint8_t prefetch; // Flag to indicate, an unused prefetch fills it
+} APEX_Mshr;
+
+typedef struct APEX_MshrStats
+{
+  long primary;     // Misses that took an MSHR
+  long merged;      // Misses to a line with an MSHR already
+  long full;        // Misses sent back to the LSQ with every MSHR in use
+  long busy_cycles; // MSHR cycles of the fills allocated so far
+  int peak;         // Most MSHRs in use at once
+} APEX_MshrStats;
+
+/* Second level of the data memory page table */
+typedef struct APEX_PageTable
+{
+  int *pages[APEX_TABLE_PAGES]; // APEX_PAGE_WORDS words each, or NULL
+} APEX_PageTable;
+
+/* Entry of the prefetch table. The stride prefetcher indexes it by pc
+ * and tracks addresses, the stream prefetcher tracks runs of lines
+ */
+typedef struct APEX_PrefetchEntry
+{
+  int32_t tag;    // Pc of a stride entry, 0 for a stream, -1 when empty
+  int32_t last;   // Last address, or line of a stream
+  int32_t stride; // Stride, or direction of a stream (0 unknown)
+  uint32_t stamp; // Cycle of the last access, for stream replacement
+  uint8_t conf;   // Saturating confidence in the stride
+} APEX_PrefetchEntry;
+
+typedef struct APEX_PrefetchStats
+{
+  long issued;  // Prefetches sent to the caches
+  long dropped; // Prefetches lost for want of a free MSHR
+  long useful;  // Prefetched lines a demand access used
+  long late;    // Useful prefetches the access still waited for
+  long unused;  // Prefetched lines evicted without being used
+} APEX_PrefetchStats;
+
+/* A functional unit: 'latency' consecutive stage latches followed by a
+ * retire latch
+ */
+typedef struct APEX_Unit
+{
+  int fu;          // FU_* class of the unit
+  int number;      // 1-based number within its class
+  int first_stage; // Index of the first stage latch
+  int latency;     // Number of stages
+  int ret_stage;   // Index of the retire latch
+  int pipelined;   // Flag to indicate, a new instruction can enter every cycle
+  int accepts;     // Bitmask of (1 << FU_*) instruction classes executed
+} APEX_Unit;
+
 /* Model of APEX CPU */
 typedef struct APEX_CPU
 {
@@ -129,62 +547,286 @@ typedef struct APEX_CPU
   /* HALT flag */
   int haltflag;
 
-  int LSQ_Instruction_flag;
-
-  /* Integer register file */
-  int regs[32];
-  int regs_valid[32];
+  /* Set, with haltflag, when a load or store outside data memory reaches
+   * commit; the pc and word address of that access
+   */
+  int faulted;
+  int fault_pc;
+  int fault_address;
 
-  //int rob[12];
-  CPU_Stage stage[14];
+  int LSQ_Instruction_flag;
 
-  iq IQ[8];
-  lsq LSQ[6];
-  rob ROB[12];
+  /* Architectural register file, written as instructions commit */
+  int regs[NUM_ARCH_REGS];
+
+  /* Physical register file. Decode renames destinations through
+   * rename_table to registers taken from the prf_free bitset; arch_map
+   * holds the committed mapping, and the register an instruction's Rd was
+   * mapped to before it is freed when it commits
+   */
+  int *prf;
+  uint8_t rename_table[NUM_ARCH_REGS];
+  uint8_t arch_map[NUM_ARCH_REGS];
+  int free_count;
+
+  /* Branches in flight: the tags in use, and the snapshot taken when
+   * each was dispatched
+   */
+  uint32_t br_active;
+  APEX_Snapshot snapshots[APEX_MAX_BRANCH_TAGS];
+
+  /* Zero flag of the last committed arithmetic result, tested by BZ and
+   * BNZ. z_rob is the ROB entry of the youngest instruction in flight that
+   * sets it, or -1
+   */
+  int z_flag;
+  int z_rob;
+
+  /* Branch prediction, see bpred.c */
+  APEX_BTBEntry *btb;
+  uint8_t *bpred_counters;
+  uint32_t ghr;                   // Speculative global history
+  APEX_BranchStats *branch_stats; // By code memory index
+  long btb_lookups;
+  long btb_hits;
+
+  /* Data cache hierarchy, see cache.c. Loads access it in the last stage
+   * of a MEM unit and stores when they commit
+   */
+  APEX_Cache caches[APEX_CACHE_LEVELS];
+  int num_caches;
+  uint32_t cache_tick; // Order of cache accesses, for replacement
+  uint32_t cache_rng;  // State of random replacement
+  APEX_Mshr *mshrs;    // config.mshrs entries once there is a cache
+  int num_mshrs;
+  APEX_MshrStats mshr_stats;
+
+  /* Prefetcher, see prefetch.c. It observes the addresses of loads as
+   * they access the cache and of stores as they commit
+   */
+  APEX_PrefetchEntry *prefetch_table;
+  APEX_PrefetchStats prefetch_stats;
+
+  APEX_Config config;
+
+  /* Pipeline latches in two banks of num_stages: stages read the current
+   * bank through 'stage' and write the next one through 'next', and the
+   * pointers are swapped once per cycle
+   */
+  CPU_Stage *latches;
+  CPU_Stage *stage;
+  CPU_Stage *next;
+  int num_stages;
+
+  /* Functional units, in retire priority order */
+  APEX_Unit *units;
+  int num_units;
+
+  /* Unit the round robin result bus arbitration starts from */
+  int cdb_next;
+
+  iq *IQ;
+  lsq *LSQ;
+  rob *ROB;
+  int iq_count;
+  uint32_t dispatch_seq;
+
+  /* The ROB and LSQ are circular buffers of *_count entries from *_head */
+  int rob_head;
+  int rob_tail;
+  int rob_count;
+  int lsq_head;
+  int lsq_tail;
+  int lsq_count;
+
+  /* Bitsets, carved from one allocation of bits_words words */
+  APEX_Bits *bits;
+  int bits_words;
+  int num_tags;                        // Physical registers
+  int tag_words;                       // Words of a bitset over the PRF
+  int iq_words;                        // Words of a bitset over the IQ
+  int lsq_words;                       // Words of a bitset over the LSQ
+  APEX_Bits *reg_ready;                // Tags holding their value
+  APEX_Bits *prf_free;                 // Free physical registers
+  APEX_Bits *br_alloc;                 // Per branch, registers renamed
+  APEX_Bits *iq_used;                  // Occupied IQ entries
+  APEX_Bits *iq_ready[NUM_FU_CLASSES]; // Issuable IQ entries by unit class
+  APEX_Bits *iq_waiters;               // Per tag, IQ entries waiting on it
+  APEX_Bits *lsq_waiters;              // Per tag, stores waiting on data
+  APEX_Bits *iq_branch;                // Per branch, younger IQ entries
+  APEX_Bits *lsq_branch;               // Per branch, younger LSQ entries
   /* Code Memory where instructions are stored */
   APEX_Instruction *code_memory;
   int code_memory_size;
 
-  /* Data Memory */
-  int data_memory[4096];
+  /* Program image backing code memory, NULL if it was parsed from text */
+  void *code_mapping;
+  size_t code_mapping_size;
+
+  /* Flag to indicate, code memory is freed with the cpu */
+  int owns_code;
+
+  /* Flag to indicate, stages print their content every cycle */
+  int debug;
+
+  /* Flag to indicate, fetch is held until the pipeline is empty */
+  int draining;
+
+  /* Data memory, see memory.c. Pages are allocated as they are written,
+   * so a large data_memory_size costs only the page directory
+   */
+  APEX_PageTable **page_dir;
+  int num_page_tables;
+  int pages_used;
 
   /* Some stats */
   int ins_completed;
+  long ins_fast_forwarded;
+  long ins_squashed;
+  long stalls[NUM_STALLS];
 
 } APEX_CPU;
 
 APEX_Instruction *
 create_code_memory(const char *filename, int *size);
 
+int apex_lookup_opcode(const char *name, size_t len);
+
+int apex_is_image(const char *filename);
+
+int apex_image_write(const char *filename, const APEX_Instruction *code,
+                     int size);
+
+APEX_Instruction *
+apex_image_map(const char *filename, int *size, void **mapping,
+               size_t *mapping_size);
+
+void apex_image_unmap(void *mapping, size_t mapping_size);
+
+APEX_Instruction *
+load_code_memory(const char *filename, int *size, void **mapping,
+                 size_t *mapping_size);
+
+void free_code_memory(APEX_Instruction *code_memory, void *mapping,
+                      size_t mapping_size);
+
+void apex_config_default(APEX_Config *config);
+
+int apex_config_set(APEX_Config *config, const char *key, const char *value);
+
+int apex_config_load(APEX_Config *config, const char *filename);
+
+int apex_config_args(APEX_Config *config, int argc, char const *argv[]);
+
+int apex_config_validate(const APEX_Config *config);
+
 APEX_CPU *
-APEX_cpu_init(const char *filename);
+APEX_cpu_create(APEX_Instruction *code_memory, int code_memory_size,
+                const APEX_Config *config);
+
+APEX_CPU *
+APEX_cpu_init(const char *filename, const APEX_Config *config);
 
 int APEX_cpu_run(APEX_CPU *cpu, const char *function, const char *totalcycles);
 
+int APEX_cpu_simulate(APEX_CPU *cpu, int cycles);
+
+int APEX_cpu_finished(APEX_CPU *cpu);
+
+long APEX_cpu_fast_forward(APEX_CPU *cpu, long max_instructions, int stop_pc);
+
+int APEX_cpu_drain(APEX_CPU *cpu);
+
+int APEX_cpu_sample(APEX_CPU *cpu, long skip, int warmup, int window,
+                    long max_cycles, APEX_SampleStats *stats);
+
+void APEX_sample_report(const APEX_SampleStats *stats);
+
 void APEX_cpu_stop(APEX_CPU *cpu);
 
+int apex_bpred_create(APEX_CPU *cpu);
+
+void apex_bpred_free(APEX_CPU *cpu);
+
+int apex_bpred_predict(APEX_CPU *cpu, int pc, int op, int *shifted);
+
+void apex_bpred_recover(APEX_CPU *cpu, uint32_t ghr, int shifted, int taken);
+
+void apex_bpred_update(APEX_CPU *cpu, const rob *entry);
+
+void apex_bpred_report(APEX_CPU *cpu);
+
+int apex_memory_create(APEX_CPU *cpu);
+
+void apex_memory_free(APEX_CPU *cpu);
+
+void apex_memory_clear(APEX_CPU *cpu);
+
+int apex_memory_pages(const APEX_CPU *cpu);
+
+int *apex_memory_page(APEX_CPU *cpu, int page, int create);
+
+int apex_memory_read(APEX_CPU *cpu, int address);
+
+int apex_memory_write(APEX_CPU *cpu, int address, int value);
+
+int apex_memory_load(APEX_CPU *cpu, const char *filename, int address);
+
+int apex_memory_dump(APEX_CPU *cpu, const char *filename, int start, int end,
+                     int sparse);
+
+int apex_cache_create(APEX_CPU *cpu);
+
+void apex_cache_free(APEX_CPU *cpu);
+
+int apex_cache_access(APEX_CPU *cpu, int address, int write);
+
+int apex_cache_load(APEX_CPU *cpu, int address, int *cycles);
+
+int apex_cache_prefetch(APEX_CPU *cpu, int address);
+
+void apex_cache_report(APEX_CPU *cpu);
+
+int apex_prefetch_create(APEX_CPU *cpu);
+
+void apex_prefetch_free(APEX_CPU *cpu);
+
+void apex_prefetch_observe(APEX_CPU *cpu, int pc, int address);
+
+void apex_prefetch_report(APEX_CPU *cpu);
+
+int APEX_cpu_checkpoint(APEX_CPU *cpu, const char *filename);
+
+int APEX_cpu_restore(APEX_CPU *cpu, const char *filename);
+
+int apex_checkpoint_config(const char *filename, APEX_Config *config);
+
 int fetch(APEX_CPU *cpu);
 
 int decode(APEX_CPU *cpu);
 
-int intfu1(APEX_CPU *cpu);
+int fustage(APEX_CPU *cpu, int unit, int k);
 
-int intfu2(APEX_CPU *cpu);
+int retire(APEX_CPU *cpu);
 
-int mulfu1(APEX_CPU *cpu);
+int iqstage(APEX_CPU *cpu);
 
-int mulfu2(APEX_CPU *cpu);
+int lsqstage(APEX_CPU *cpu);
 
-int mulfu3(APEX_CPU *cpu);
+int robstage(APEX_CPU *cpu);
 
-int mulfu1(APEX_CPU *cpu);
+int commit(APEX_CPU *cpu);
 
-int memfu1(APEX_CPU *cpu);
+int get_ROB(APEX_CPU *cpu, CPU_Stage *stage);
 
-int memfu2(APEX_CPU *cpu);
+int get_LSQ(APEX_CPU *cpu, CPU_Stage *stage);
 
-int memfu3(APEX_CPU *cpu);
+int get_PR(APEX_CPU *cpu);
 
-int retire(APEX_CPU *cpu);
+void free_PR(APEX_CPU *cpu, int pr);
+
+int get_BT(APEX_CPU *cpu, CPU_Stage *stage);
+
+void ROB_Flush(APEX_CPU *cpu, int index);
 
 #endif
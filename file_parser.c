@@ -7,6 +7,8 @@
  *  
  *  State University of New York, Binghamton
  */
+#include <ctype.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,110 +16,240 @@
 #include "cpu.h"
 
 /*
- * This function is related to parsing input file
+ * Operand layout of every instruction format
  *
- * Note : You are not supposed to edit this function
+ * Note : Stages read the source registers and the destination flag from
+ * this table instead of comparing opcode strings
  */
-static int
-get_num_from_string(char* buffer)
-{
-  char str[16];
-  int j = 0;
-  for (int i = 1; buffer[i] != '\0'; ++i) {
-    str[j] = buffer[i];
-    j++;
-  }
-  str[j] = '\0';
-  return atoi(str);
-}
+const APEX_Format apex_formats[NUM_FORMATS] = {
+  [FMT_NONE] = { 0, { 0 }, 0, 0 },
+  [FMT_RD_IMM] = { 2, { OPND_RD, OPND_IMM }, 0, 1 },
+  [FMT_RD_RS1_RS2] = { 3,
+                       { OPND_RD, OPND_RS1, OPND_RS2 },
+                       (1 << OPND_RS1) | (1 << OPND_RS2),
+                       1 },
+  [FMT_RD_RS1_IMM] = { 3, { OPND_RD, OPND_RS1, OPND_IMM }, 1 << OPND_RS1, 1 },
+  [FMT_RS1_RS2_IMM] = { 3,
+                        { OPND_RS1, OPND_RS2, OPND_IMM },
+                        (1 << OPND_RS1) | (1 << OPND_RS2),
+                        0 },
+  [FMT_RS1_RS2_RS3] = { 3,
+                        { OPND_RS1, OPND_RS2, OPND_RS3 },
+                        (1 << OPND_RS1) | (1 << OPND_RS2) | (1 << OPND_RS3),
+                        0 },
+  [FMT_IMM] = { 1, { OPND_IMM }, 0, 0 },
+  [FMT_RS1_IMM] = { 2, { OPND_RS1, OPND_IMM }, 1 << OPND_RS1, 0 },
+};
 
 /*
- * This function is related to parsing input file
+ * Mnemonic, operand format and functional unit class of every opcode
  *
- * Note : you can edit this function to add new instructions
+ * Note : you can edit this table to add new instructions
  */
-static void
-create_APEX_instruction(APEX_Instruction* ins, char* buffer)
+const APEX_OpInfo apex_op_info[NUM_OPCODES] = {
+  [OP_EMPTY] = { "EMPTY", FMT_NONE, FU_NONE },
+  [OP_ADD] = { "ADD", FMT_RD_RS1_RS2, FU_INT },
+  [OP_SUB] = { "SUB", FMT_RD_RS1_RS2, FU_INT },
+  [OP_MUL] = { "MUL", FMT_RD_RS1_RS2, FU_MUL },
+  [OP_AND] = { "AND", FMT_RD_RS1_RS2, FU_INT },
+  [OP_OR] = { "OR", FMT_RD_RS1_RS2, FU_INT },
+  [OP_EXOR] = { "EX-OR", FMT_RD_RS1_RS2, FU_INT },
+  [OP_ADDL] = { "ADDL", FMT_RD_RS1_IMM, FU_INT },
+  [OP_SUBL] = { "SUBL", FMT_RD_RS1_IMM, FU_INT },
+  [OP_MOVC] = { "MOVC", FMT_RD_IMM, FU_INT },
+  [OP_LOAD] = { "LOAD", FMT_RD_RS1_IMM, FU_MEM },
+  [OP_LDR] = { "LDR", FMT_RD_RS1_RS2, FU_MEM },
+  [OP_STORE] = { "STORE", FMT_RS1_RS2_IMM, FU_MEM },
+  [OP_STR] = { "STR", FMT_RS1_RS2_RS3, FU_MEM },
+  [OP_BZ] = { "BZ", FMT_IMM, FU_INT },
+  [OP_BNZ] = { "BNZ", FMT_IMM, FU_INT },
+  [OP_JUMP] = { "JUMP", FMT_RS1_IMM, FU_INT },
+  [OP_HALT] = { "HALT", FMT_NONE, FU_NONE },
+};
+
+/*
+ * Maps a mnemonic of 'len' characters to its OP_* opcode class, OP_EMPTY
+ * if unknown
+ */
+int
+apex_lookup_opcode(const char* name, size_t len)
 {
-  char* token = strtok(buffer, ",");
-  int token_num = 0;
-  char tokens[6][128];
-  while (token != NULL) {
-    strcpy(tokens[token_num], token);
-    token_num++;
-    token = strtok(NULL, ",");
+  for (int op = OP_EMPTY + 1; op < NUM_OPCODES; ++op) {
+    if (strncmp(apex_op_info[op].name, name, len) == 0 &&
+        apex_op_info[op].name[len] == '\0') {
+      return op;
+    }
   }
+  return OP_EMPTY;
+}
 
-  strcpy(ins->opcode, tokens[0]);
+/* Position of the tokenizer within the line being parsed */
+typedef struct APEX_Lexer
+{
+  const char* p;        // Next character to read
+  const char* filename; // For error messages
+  int line;             // 1-based line number
+} APEX_Lexer;
 
-  if (strcmp(ins->opcode, "MOVC") == 0) {
-    ins->rd = get_num_from_string(tokens[1]);
-    ins->imm = get_num_from_string(tokens[2]);
-  }
+static int
+parse_error(const APEX_Lexer* lex, const char* message)
+{
+  fprintf(stderr, "APEX_Error : %s:%d: %s\n", lex->filename, lex->line,
+          message);
+  return -1;
+}
 
-  if (strcmp(ins->opcode, "STORE") == 0) {
-    ins->rs1 = get_num_from_string(tokens[1]);
-    ins->rs2 = get_num_from_string(tokens[2]);
-    ins->imm = get_num_from_string(tokens[3]);
+static void
+skip_blanks(APEX_Lexer* lex)
+{
+  while (*lex->p == ' ' || *lex->p == '\t' || *lex->p == '\r') {
+    lex->p++;
   }
+}
 
-  if (strcmp(ins->opcode, "STR") == 0)
-  {
-    ins->rs1 = get_num_from_string(tokens[1]);
-    ins->rs2 = get_num_from_string(tokens[2]);
-    ins->rs3 = get_num_from_string(tokens[3]);
-  }
+static int
+at_line_end(APEX_Lexer* lex)
+{
+  skip_blanks(lex);
+  return *lex->p == '\0' || *lex->p == '\n';
+}
 
-  if (strcmp(ins->opcode, "MOVC") == 0)
-  {
-    ins->rd = get_num_from_string(tokens[1]);
-    ins->imm = get_num_from_string(tokens[2]);
+/*
+ * Reads a decimal number with an optional sign into 'value'
+ */
+static int
+lex_number(APEX_Lexer* lex, long min, long max, int* value)
+{
+  const char* p = lex->p;
+  int negative = 0;
+  long v = 0;
+
+  if (*p == '-' || *p == '+') {
+    negative = *p == '-';
+    p++;
+  }
+  if (!isdigit((unsigned char)*p)) {
+    return parse_error(lex, "expected a number");
+  }
+  while (isdigit((unsigned char)*p)) {
+    v = v * 10 + (*p - '0');
+    if (v > (long)INT_MAX + 1) {
+      return parse_error(lex, "number out of range");
+    }
+    p++;
   }
+  v = negative ? -v : v;
+  if (v < min || v > max) {
+    return parse_error(lex, "number out of range");
+  }
+  lex->p = p;
+  *value = (int)v;
+  return 0;
+}
 
-  if (strcmp(ins->opcode, "ADD") == 0 ||
-      strcmp(ins->opcode, "SUB") == 0 ||
-      strcmp(ins->opcode, "AND") == 0 ||
-      strcmp(ins->opcode, "OR") == 0 ||
-      strcmp(ins->opcode, "EX-OR") == 0 ||
-      strcmp(ins->opcode, "MUL") == 0||
-      strcmp(ins->opcode, "LDR") == 0)
-  {
-    ins->rd = get_num_from_string(tokens[1]);
-    ins->rs1 = get_num_from_string(tokens[2]);
-    ins->rs2 = get_num_from_string(tokens[3]);
+/*
+ * Reads one operand of the given OPND_* kind: Rn for registers, #n for
+ * literals
+ */
+static int
+lex_operand(APEX_Lexer* lex, int kind, int* value)
+{
+  skip_blanks(lex);
+  if (kind == OPND_IMM) {
+    if (*lex->p != '#') {
+      return parse_error(lex, "expected a literal '#n'");
+    }
+    lex->p++;
+    return lex_number(lex, INT_MIN, INT_MAX, value);
   }
 
-  if (strcmp(ins->opcode, "LOAD") == 0 ||
-      strcmp(ins->opcode, "ADDL") == 0 ||
-      strcmp(ins->opcode, "SUBL") == 0)
-  {
-    ins->rd = get_num_from_string(tokens[1]);
-    ins->rs1 = get_num_from_string(tokens[2]);
-    ins->imm = get_num_from_string(tokens[3]);
+  if (*lex->p != 'R' && *lex->p != 'r') {
+    return parse_error(lex, "expected a register 'Rn'");
+  }
+  lex->p++;
+  if (*lex->p == '-' || *lex->p == '+') {
+    return parse_error(lex, "expected a register 'Rn'");
+  }
+  if (lex_number(lex, 0, NUM_ARCH_REGS - 1, value) != 0) {
+    return -1;
   }
+  return 0;
+}
 
-  if (strcmp(ins->opcode, "BZ") == 0 ||
-      strcmp(ins->opcode, "BNZ") == 0)
-  {
-    ins->imm = get_num_from_string(tokens[1]);
+/*
+ * This function is related to parsing input file
+ *
+ * Decodes one line into 'ins'. Returns 1 for an instruction, 0 for a
+ * blank line and -1 on a malformed line
+ *
+ * Note : instructions are decoded here once; new instructions are added
+ * to apex_op_info above
+ */
+static int
+create_APEX_instruction(APEX_Instruction* ins, APEX_Lexer* lex)
+{
+  if (at_line_end(lex)) {
+    return 0;
   }
 
-  if (strcmp(ins->opcode, "JUMP") == 0)
-  {
-    ins->rs1 = get_num_from_string(tokens[1]);
+  const char* name = lex->p;
+  while (isalnum((unsigned char)*lex->p) || *lex->p == '-') {
+    lex->p++;
+  }
+  memset(ins, 0, sizeof(*ins));
+  ins->op = apex_lookup_opcode(name, lex->p - name);
+  if (ins->op == OP_EMPTY) {
+    lex->p = name;
+    return parse_error(lex, "unknown opcode");
   }
 
-  if (strcmp(ins->opcode, "HALT") == 0)
-  {
-    
+  const APEX_Format* fmt = &apex_formats[apex_op_info[ins->op].format];
+  for (int i = 0; i < fmt->num_operands; ++i) {
+    int value;
+    skip_blanks(lex);
+    if (*lex->p != ',') {
+      return parse_error(lex, "missing operand");
+    }
+    lex->p++;
+    if (lex_operand(lex, fmt->operands[i], &value) != 0) {
+      return -1;
+    }
+    switch (fmt->operands[i]) {
+      case OPND_RD:
+        ins->rd = value;
+        break;
+      case OPND_RS1:
+        ins->rs1 = value;
+        break;
+      case OPND_RS2:
+        ins->rs2 = value;
+        break;
+      case OPND_RS3:
+        ins->rs3 = value;
+        break;
+      case OPND_IMM:
+        ins->imm = value;
+        break;
+    }
   }
 
+  /* A trailing comma is accepted, as in "HALT," */
+  skip_blanks(lex);
+  if (*lex->p == ',') {
+    lex->p++;
+  }
+  if (!at_line_end(lex)) {
+    return parse_error(lex, "unexpected text after last operand");
+  }
+  return 1;
 }
 
 /*
  * This function is related to parsing input file
  *
- * Note : You are not supposed to edit this function
+ * Reads the file in a single pass into a growing code memory. Blank lines
+ * are skipped; the first malformed line is reported with its line number
+ * and fails the whole parse
  */
 APEX_Instruction*
 create_code_memory(const char* filename, int* size)
@@ -133,33 +265,40 @@ create_code_memory(const char* filename, int* size)
 
   char* line = NULL;
   size_t len = 0;
-  ssize_t nread;
   int code_memory_size = 0;
+  int capacity = 1024;
+  APEX_Instruction* code_memory = malloc(sizeof(*code_memory) * capacity);
+  APEX_Lexer lex = { NULL, filename, 0 };
+  int status = code_memory ? 0 : -1;
 
-  while ((nread = getline(&line, &len, fp)) != -1) {
-    code_memory_size++;
-  }
-  *size = code_memory_size;
-  if (!code_memory_size) {
-    fclose(fp);
-    return NULL;
-  }
-
-  APEX_Instruction* code_memory =
-    malloc(sizeof(*code_memory) * code_memory_size);
-  if (!code_memory) {
-    fclose(fp);
-    return NULL;
-  }
+  while (status == 0 && getline(&line, &len, fp) != -1) {
+    if (code_memory_size == capacity) {
+      APEX_Instruction* grown =
+        realloc(code_memory, sizeof(*code_memory) * capacity * 2);
+      if (!grown) {
+        status = -1;
+        break;
+      }
+      code_memory = grown;
+      capacity *= 2;
+    }
 
-  rewind(fp);
-  int current_instruction = 0;
-  while ((nread = getline(&line, &len, fp)) != -1) {
-    create_APEX_instruction(&code_memory[current_instruction], line);
-    current_instruction++;
+    lex.p = line;
+    lex.line++;
+    int ret = create_APEX_instruction(&code_memory[code_memory_size], &lex);
+    if (ret < 0) {
+      status = -1;
+    } else {
+      code_memory_size += ret;
+    }
   }
 
   free(line);
   fclose(fp);
+  *size = code_memory_size;
+  if (status != 0 || !code_memory_size) {
+    free(code_memory);
+    return NULL;
+  }
   return code_memory;
 }
@@ -0,0 +1,176 @@
+/*
+ *  image.c
+ *  Contains functions to write pre-assembled program images and to map
+ *  them as code memory without parsing
+ *
+ *  Author :
+ *
+ *  State University of New York, Binghamton
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cpu.h"
+
+static const char image_magic[4] = { 'A', 'P', 'X', 'I' };
+
+/*
+ * Returns 1 if the file starts with the program image magic
+ */
+int
+apex_is_image(const char* filename)
+{
+  char magic[sizeof(image_magic)];
+  FILE* fp = fopen(filename, "rb");
+  if (!fp) {
+    return 0;
+  }
+
+  size_t n = fread(magic, 1, sizeof(magic), fp);
+  fclose(fp);
+  return n == sizeof(magic) && memcmp(magic, image_magic, sizeof(magic)) == 0;
+}
+
+/*
+ * Writes decoded code memory as a program image
+ *
+ * Note : Records are written in host byte order, images are meant to be
+ * consumed on the machine that assembled them
+ */
+int
+apex_image_write(const char* filename, const APEX_Instruction* code, int size)
+{
+  FILE* fp = fopen(filename, "wb");
+  if (!fp) {
+    return -1;
+  }
+
+  APEX_ImageHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, image_magic, sizeof(image_magic));
+  header.version = APEX_IMAGE_VERSION;
+  header.record_size = sizeof(APEX_Instruction);
+  header.num_instructions = size;
+
+  int ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+           fwrite(code, sizeof(*code), size, fp) == (size_t)size;
+  if (fclose(fp) != 0) {
+    ok = 0;
+  }
+  return ok ? 0 : -1;
+}
+
+/*
+ * Returns 1 if 'ins' is an instruction the text front end could have
+ * produced: a known opcode and registers within the architectural file
+ */
+static int
+valid_record(const APEX_Instruction* ins)
+{
+  return ins->op > OP_EMPTY && ins->op < NUM_OPCODES &&
+         ins->rd < NUM_ARCH_REGS && ins->rs1 < NUM_ARCH_REGS &&
+         ins->rs2 < NUM_ARCH_REGS && ins->rs3 < NUM_ARCH_REGS;
+}
+
+/*
+ * Maps a program image read-only and returns its instruction records,
+ * which are used directly as code memory. Every record is checked, and
+ * the first invalid one is reported with its index. The mapping is handed back
+ * through 'mapping'/'mapping_size' for apex_image_unmap
+ */
+APEX_Instruction*
+apex_image_map(const char* filename,
+               int* size,
+               void** mapping,
+               size_t* mapping_size)
+{
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(APEX_ImageHeader)) {
+    close(fd);
+    return NULL;
+  }
+
+  void* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    return NULL;
+  }
+
+  const APEX_ImageHeader* header = base;
+  size_t records = (st.st_size - sizeof(*header)) / sizeof(APEX_Instruction);
+  if (memcmp(header->magic, image_magic, sizeof(image_magic)) != 0 ||
+      header->version != APEX_IMAGE_VERSION ||
+      header->record_size != sizeof(APEX_Instruction) ||
+      header->num_instructions == 0 || header->num_instructions > records) {
+    fprintf(stderr, "APEX_Error : %s is not a version %d program image\n",
+            filename, APEX_IMAGE_VERSION);
+    munmap(base, st.st_size);
+    return NULL;
+  }
+
+  const APEX_Instruction* code = (const APEX_Instruction*)(header + 1);
+  for (uint32_t i = 0; i < header->num_instructions; ++i) {
+    if (!valid_record(&code[i])) {
+      fprintf(stderr, "APEX_Error : %s: record %u: invalid instruction\n",
+              filename, i);
+      munmap(base, st.st_size);
+      return NULL;
+    }
+  }
+
+  madvise(base, st.st_size, MADV_SEQUENTIAL);
+  *size = header->num_instructions;
+  *mapping = base;
+  *mapping_size = st.st_size;
+  return (APEX_Instruction*)(header + 1);
+}
+
+void
+apex_image_unmap(void* mapping, size_t mapping_size)
+{
+  munmap(mapping, mapping_size);
+}
+
+/*
+ * Loads a program for use as code memory: program images are mapped,
+ * anything else is parsed as assembly text. A mapped image is returned
+ * through 'mapping', which is NULL for parsed programs
+ */
+APEX_Instruction*
+load_code_memory(const char* filename,
+                 int* size,
+                 void** mapping,
+                 size_t* mapping_size)
+{
+  *mapping = NULL;
+  *mapping_size = 0;
+  if (!filename) {
+    return NULL;
+  }
+  if (apex_is_image(filename)) {
+    return apex_image_map(filename, size, mapping, mapping_size);
+  }
+  return create_code_memory(filename, size);
+}
+
+void
+free_code_memory(APEX_Instruction* code_memory,
+                 void* mapping,
+                 size_t mapping_size)
+{
+  if (mapping) {
+    apex_image_unmap(mapping, mapping_size);
+  } else {
+    free(code_memory);
+  }
+}
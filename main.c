@@ -6,27 +6,165 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "cpu.h"
 
 int
 main(int argc, char const* argv[])
 {
-  if (argc != 4) {
-    fprintf(stderr, "APEX_Help : Usage %s <input_file>\n", argv[0]);
+  if (argc < 4) {
+    fprintf(stderr,
+            "APEX_Help : Usage %s <input_file> <display|simulate> <cycles> "
+            "[--config <file>] [--fast-forward <instructions>] "
+            "[--switch-pc <pc>] [--restore <file>] "
+            "[--checkpoint <cycle> <file>] "
+            "[--sample <skip> <warmup> <window>] [--data <file> <address>] "
+            "[--dump <file> <start> <end>] [--dump-sparse <file> <start> "
+            "<end>] [key=value ...]\n",
+            argv[0]);
     exit(1);
   }
 
-  APEX_CPU* cpu = APEX_cpu_init(argv[1]);
+  /* Microarchitecture parameters: defaults, then a config file, then
+   * key=value overrides
+   */
+  APEX_Config config;
+  apex_config_default(&config);
+  long fast_forward = 0;
+  int switch_pc = -1;
+  const char* restore_file = NULL;
+  const char* checkpoint_file = NULL;
+  int checkpoint_cycle = 0;
+  long sample_skip = 0;
+  int sample_warmup = 0;
+  int sample_window = 0;
+  const char* data_file = NULL;
+  int data_address = 0;
+  /* Data memory ranges written out after the run */
+  struct
+  {
+    const char* file;
+    int start;
+    int end;
+    int sparse;
+  } dumps[argc];
+  int num_dumps = 0;
+  for (int i = 4; i < argc; ++i) {
+    if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+      if (apex_config_load(&config, argv[++i]) != 0) {
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--fast-forward") == 0 && i + 1 < argc) {
+      fast_forward = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--switch-pc") == 0 && i + 1 < argc) {
+      switch_pc = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+      restore_file = argv[++i];
+    } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 2 < argc) {
+      checkpoint_cycle = atoi(argv[++i]);
+      checkpoint_file = argv[++i];
+    } else if (strcmp(argv[i], "--sample") == 0 && i + 3 < argc) {
+      sample_skip = atol(argv[++i]);
+      sample_warmup = atoi(argv[++i]);
+      sample_window = atoi(argv[++i]);
+      if (sample_window <= 0) {
+        fprintf(stderr, "APEX_Error : Sample window must be positive\n");
+        exit(1);
+      }
+    } else if (strcmp(argv[i], "--data") == 0 && i + 2 < argc) {
+      data_file = argv[++i];
+      data_address = atoi(argv[++i]);
+    } else if ((strcmp(argv[i], "--dump") == 0 ||
+                strcmp(argv[i], "--dump-sparse") == 0) &&
+               i + 3 < argc) {
+      dumps[num_dumps].sparse = strcmp(argv[i], "--dump-sparse") == 0;
+      dumps[num_dumps].file = argv[++i];
+      dumps[num_dumps].start = atoi(argv[++i]);
+      dumps[num_dumps].end = atoi(argv[++i]);
+      num_dumps++;
+    } else if (apex_config_args(&config, 1, &argv[i]) != 1) {
+      fprintf(stderr, "APEX_Error : Bad argument %s\n", argv[i]);
+      exit(1);
+    }
+  }
+
+  /* A checkpoint carries the parameters it was taken with */
+  if (restore_file && apex_checkpoint_config(restore_file, &config) != 0) {
+    exit(1);
+  }
+
+  APEX_CPU* cpu = APEX_cpu_init(argv[1], &config);
   if (!cpu) {
     fprintf(stderr, "APEX_Error : Unable to initialize CPU\n");
     exit(1);
   }
 
+  /* Initial data memory; a restored checkpoint brings its own */
+  if (data_file && apex_memory_load(cpu, data_file, data_address) != 0) {
+    APEX_cpu_stop(cpu);
+    exit(1);
+  }
+
+  if (restore_file) {
+    if (APEX_cpu_restore(cpu, restore_file) != 0) {
+      APEX_cpu_stop(cpu);
+      exit(1);
+    }
+    fprintf(stderr, "APEX_CPU : Restored %s at cycle %d\n", restore_file,
+            cpu->clock);
+  }
+
+  /* Execute functionally up to the switch point, then hand the warmed up
+   * state to the detailed pipeline
+   */
+  if (fast_forward > 0 || switch_pc >= 0) {
+    long n = APEX_cpu_fast_forward(cpu, fast_forward, switch_pc);
+    fprintf(stderr,
+            "APEX_CPU : Fast-forwarded %ld instructions, switching to the "
+            "pipeline at pc(%d)\n",
+            n, cpu->pc);
+  }
+
+  /* Simulate quietly up to the checkpoint cycle and save the state; the
+   * run below continues from there
+   */
+  if (checkpoint_file) {
+    if (checkpoint_cycle > cpu->clock) {
+      APEX_cpu_simulate(cpu, checkpoint_cycle - cpu->clock);
+    }
+    if (APEX_cpu_checkpoint(cpu, checkpoint_file) != 0) {
+      APEX_cpu_stop(cpu);
+      exit(1);
+    }
+    fprintf(stderr, "APEX_CPU : Saved checkpoint at cycle %d to %s\n",
+            cpu->clock, checkpoint_file);
+  }
+
   const char* function = argv[2];
   const char* totalcycles = argv[3];
 
-  APEX_cpu_run(cpu,function,totalcycles);
+  /* In sampled mode <cycles> bounds the cycles simulated in detail */
+  if (sample_window > 0) {
+    APEX_SampleStats stats;
+    APEX_cpu_sample(cpu, sample_skip, sample_warmup, sample_window,
+                    atol(totalcycles), &stats);
+    APEX_sample_report(&stats);
+  } else {
+    APEX_cpu_run(cpu,function,totalcycles);
+  }
+  /* A run stopped by a load or store outside data memory fails */
+  int status = cpu->faulted ? 1 : 0;
+
+  for (int i = 0; i < num_dumps; ++i) {
+    if (apex_memory_dump(cpu, dumps[i].file, dumps[i].start, dumps[i].end,
+                         dumps[i].sparse) != 0) {
+      APEX_cpu_stop(cpu);
+      exit(1);
+    }
+    fprintf(stderr, "APEX_CPU : Dumped data memory [%d, %d) to %s\n",
+            dumps[i].start, dumps[i].end, dumps[i].file);
+  }
   APEX_cpu_stop(cpu);
-  return 0;
-}
\ No newline at end of file
+  return status;
+}
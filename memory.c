@@ -0,0 +1,379 @@
+/*
+ *  memory.c
+ *  Contains the data memory: a sparse array of data_memory_size words,
+ *  kept in 4 KB pages that are allocated on the first write to them and
+ *  found through a two level page table. Data memory can be loaded from
+ *  and dumped to raw or sparse image files
+ *
+ *  Author :
+ *
+ *  State University of New York, Binghamton
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cpu.h"
+
+static const char data_magic[4] = { 'A', 'P', 'X', 'D' };
+
+/* Number of pages spanning data_memory_size words */
+int
+apex_memory_pages(const APEX_CPU* cpu)
+{
+  return ((int64_t)cpu->config.data_memory_size + APEX_PAGE_WORDS - 1) /
+         APEX_PAGE_WORDS;
+}
+
+/*
+ * Allocates the page directory for data_memory_size words. Page tables
+ * and pages come later, as they are written, so words never written read
+ * as 0
+ */
+int
+apex_memory_create(APEX_CPU* cpu)
+{
+  int pages = apex_memory_pages(cpu);
+
+  cpu->num_page_tables = (pages + APEX_TABLE_PAGES - 1) / APEX_TABLE_PAGES;
+  cpu->page_dir = calloc(cpu->num_page_tables, sizeof(*cpu->page_dir));
+  cpu->pages_used = 0;
+  return cpu->page_dir ? 0 : -1;
+}
+
+/*
+ * Frees every page, leaving the whole data memory zero
+ */
+void
+apex_memory_clear(APEX_CPU* cpu)
+{
+  for (int t = 0; t < cpu->num_page_tables; ++t) {
+    APEX_PageTable* table = cpu->page_dir[t];
+    if (!table) {
+      continue;
+    }
+    for (int i = 0; i < APEX_TABLE_PAGES; ++i) {
+      free(table->pages[i]);
+    }
+    free(table);
+    cpu->page_dir[t] = NULL;
+  }
+  cpu->pages_used = 0;
+}
+
+void
+apex_memory_free(APEX_CPU* cpu)
+{
+  if (cpu->page_dir) {
+    apex_memory_clear(cpu);
+  }
+  free(cpu->page_dir);
+}
+
+/*
+ * Returns page 'page' of data memory, or NULL if it was never written.
+ * With 'create', a missing page is allocated zeroed, and NULL means the
+ * allocation failed
+ */
+int*
+apex_memory_page(APEX_CPU* cpu, int page, int create)
+{
+  APEX_PageTable** table = &cpu->page_dir[page / APEX_TABLE_PAGES];
+  if (!*table) {
+    if (!create) {
+      return NULL;
+    }
+    *table = calloc(1, sizeof(**table));
+    if (!*table) {
+      return NULL;
+    }
+  }
+
+  int** words = &(*table)->pages[page % APEX_TABLE_PAGES];
+  if (!*words && create) {
+    *words = calloc(APEX_PAGE_WORDS, sizeof(int));
+    cpu->pages_used += *words != NULL;
+  }
+  return *words;
+}
+
+/*
+ * Reads data memory word 'address', which must be within
+ * data_memory_size
+ */
+int
+apex_memory_read(APEX_CPU* cpu, int address)
+{
+  const int* page = apex_memory_page(cpu, address / APEX_PAGE_WORDS, 0);
+  return page ? page[address % APEX_PAGE_WORDS] : 0;
+}
+
+/*
+ * Writes data memory word 'address', which must be within
+ * data_memory_size. Writing 0 to a page never written does not allocate
+ * it. Returns -1 if the page cannot be allocated
+ */
+int
+apex_memory_write(APEX_CPU* cpu, int address, int value)
+{
+  int* page = apex_memory_page(cpu, address / APEX_PAGE_WORDS, value != 0);
+  if (!page) {
+    return value != 0 ? -1 : 0;
+  }
+  page[address % APEX_PAGE_WORDS] = value;
+  return 0;
+}
+
+/*
+ * Copies 'words' words into data memory from 'address' on, allocating
+ * pages only for chunks that are not all zero. Returns -1 if a page
+ * cannot be allocated
+ */
+static int
+copy_in(APEX_CPU* cpu, int address, const int32_t* data, size_t words)
+{
+  while (words > 0) {
+    int offset = address % APEX_PAGE_WORDS;
+    size_t n = APEX_PAGE_WORDS - offset;
+    if (n > words) {
+      n = words;
+    }
+
+    size_t zeros = 0;
+    while (zeros < n && data[zeros] == 0) {
+      zeros++;
+    }
+    int* page = apex_memory_page(cpu, address / APEX_PAGE_WORDS, zeros < n);
+    if (page) {
+      memcpy(page + offset, data, n * sizeof(int));
+    } else if (zeros < n) {
+      return -1;
+    }
+
+    address += n;
+    data += n;
+    words -= n;
+  }
+  return 0;
+}
+
+/*
+ * Checks the runs of a sparse data image lie within data memory and the
+ * file, then copies them in
+ */
+static int
+load_sparse(APEX_CPU* cpu, const char* filename, const char* base,
+            size_t size)
+{
+  const APEX_DataHeader* header = (const APEX_DataHeader*)base;
+  if (header->version != APEX_DATA_VERSION) {
+    fprintf(stderr, "APEX_Error : %s is not a version %d data image\n",
+            filename, APEX_DATA_VERSION);
+    return -1;
+  }
+
+  for (int pass = 0; pass < 2; ++pass) {
+    size_t pos = sizeof(*header);
+    while (pos < size) {
+      APEX_DataRun run;
+      if (size - pos < sizeof(run)) {
+        fprintf(stderr, "APEX_Error : %s is truncated\n", filename);
+        return -1;
+      }
+      memcpy(&run, base + pos, sizeof(run));
+      pos += sizeof(run);
+      if ((size - pos) / sizeof(int32_t) < run.words ||
+          run.address > (uint32_t)cpu->config.data_memory_size ||
+          run.words > cpu->config.data_memory_size - run.address) {
+        fprintf(stderr, "APEX_Error : %s does not fit data memory\n",
+                filename);
+        return -1;
+      }
+      if (pass == 1 &&
+          copy_in(cpu, run.address, (const int32_t*)(base + pos),
+                  run.words) != 0) {
+        return -1;
+      }
+      pos += run.words * sizeof(int32_t);
+    }
+  }
+  return 0;
+}
+
+/*
+ * Loads data memory from a file, mapped read-only. A sparse data image
+ * (see apex_memory_dump()) goes back to the addresses it was dumped from;
+ * any other file is taken as raw 32-bit words stored from word 'address'
+ * on, and must hold a whole number of them. Pages of zero words are not
+ * allocated
+ *
+ * Note : Like program images, data files are in host byte order
+ */
+int
+apex_memory_load(APEX_CPU* cpu, const char* filename, int address)
+{
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "APEX_Error : Unable to open %s\n", filename);
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return -1;
+  }
+  size_t size = st.st_size;
+  if (size == 0) {
+    close(fd);
+    return 0;
+  }
+
+  void* base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "APEX_Error : Unable to map %s\n", filename);
+    return -1;
+  }
+  madvise(base, size, MADV_SEQUENTIAL);
+
+  int status;
+  if (size >= sizeof(APEX_DataHeader) &&
+      memcmp(base, data_magic, sizeof(data_magic)) == 0) {
+    status = load_sparse(cpu, filename, base, size);
+  } else if (size % sizeof(int32_t) != 0) {
+    fprintf(stderr,
+            "APEX_Error : %s is not a whole number of 32-bit words (%zu "
+            "bytes)\n",
+            filename, size);
+    status = -1;
+  } else if (address < 0 || address > cpu->config.data_memory_size ||
+             size / sizeof(int32_t) >
+               (size_t)(cpu->config.data_memory_size - address)) {
+    fprintf(stderr, "APEX_Error : %s does not fit data memory at %d\n",
+            filename, address);
+    status = -1;
+  } else {
+    status = copy_in(cpu, address, base, size / sizeof(int32_t));
+  }
+  munmap(base, size);
+  return status;
+}
+
+/*
+ * Returns the page holding word 'address', or a page of zeros if it was
+ * never written
+ */
+static const int*
+page_of(APEX_CPU* cpu, int address)
+{
+  static const int zeros[APEX_PAGE_WORDS];
+  const int* page = apex_memory_page(cpu, address / APEX_PAGE_WORDS, 0);
+  return page ? page : zeros;
+}
+
+/* Number of zero words from which a sparse run is split in two */
+#define RUN_GAP (sizeof(APEX_DataRun) / sizeof(int32_t) + 1)
+
+static int
+dump_sparse(APEX_CPU* cpu, FILE* fp, int start, int end)
+{
+  APEX_DataHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, data_magic, sizeof(data_magic));
+  header.version = APEX_DATA_VERSION;
+  if (fwrite(&header, sizeof(header), 1, fp) != 1) {
+    return -1;
+  }
+
+  /* Wide enough to step past the last page when 'end' is INT_MAX */
+  int64_t address = start;
+  while (address < end) {
+    /* Skip zeros, a page never written at a time */
+    if (!apex_memory_page(cpu, address / APEX_PAGE_WORDS, 0)) {
+      address += APEX_PAGE_WORDS - address % APEX_PAGE_WORDS;
+      continue;
+    }
+    if (page_of(cpu, address)[address % APEX_PAGE_WORDS] == 0) {
+      address++;
+      continue;
+    }
+
+    /* A run ends with its last non-zero word before a gap of zeros */
+    int last = address;
+    for (int a = address + 1; a < end && (size_t)(a - last) < RUN_GAP; ++a) {
+      if (page_of(cpu, a)[a % APEX_PAGE_WORDS] != 0) {
+        last = a;
+      }
+    }
+
+    APEX_DataRun run = { address, last + 1 - address };
+    if (fwrite(&run, sizeof(run), 1, fp) != 1) {
+      return -1;
+    }
+    while (address <= last) {
+      int n = APEX_PAGE_WORDS - address % APEX_PAGE_WORDS;
+      if (n > last + 1 - address) {
+        n = last + 1 - address;
+      }
+      const int* page = page_of(cpu, address);
+      if (fwrite(page + address % APEX_PAGE_WORDS, sizeof(int), n, fp) !=
+          (size_t)n) {
+        return -1;
+      }
+      address += n;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Writes data memory words 'start' up to 'end' to a file: as raw 32-bit
+ * words, or with 'sparse' as a data image of the runs of non-zero words,
+ * which apex_memory_load() restores to the same addresses. The range is
+ * clipped to data memory
+ */
+int
+apex_memory_dump(APEX_CPU* cpu, const char* filename, int start, int end,
+                 int sparse)
+{
+  if (start < 0) {
+    start = 0;
+  }
+  if (end > cpu->config.data_memory_size) {
+    end = cpu->config.data_memory_size;
+  }
+
+  FILE* fp = fopen(filename, "wb");
+  if (!fp) {
+    fprintf(stderr, "APEX_Error : Unable to create %s\n", filename);
+    return -1;
+  }
+
+  int ok;
+  if (sparse) {
+    ok = dump_sparse(cpu, fp, start, end) == 0;
+  } else {
+    ok = 1;
+    for (int address = start; ok && address < end;) {
+      int n = APEX_PAGE_WORDS - address % APEX_PAGE_WORDS;
+      if (n > end - address) {
+        n = end - address;
+      }
+      ok = fwrite(page_of(cpu, address) + address % APEX_PAGE_WORDS,
+                  sizeof(int), n, fp) == (size_t)n;
+      address += n;
+    }
+  }
+  if (fclose(fp) != 0) {
+    ok = 0;
+  }
+  if (!ok) {
+    fprintf(stderr, "APEX_Error : Unable to write %s\n", filename);
+  }
+  return ok ? 0 : -1;
+}
@@ -0,0 +1,224 @@
+/*
+ *  prefetch.c
+ *  Contains the hardware prefetchers of the data memory path: next-line,
+ *  pc-indexed stride and stream prefetchers that observe the addresses of
+ *  loads and stores and fill the caches ahead of them, with accuracy,
+ *  coverage and timeliness statistics
+ *
+ *  Author :
+ *
+ *  State University of New York, Binghamton
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cpu.h"
+
+/* A prefetcher: trains on every demand access and prefetches through
+ * apex_cache_prefetch()
+ */
+typedef struct Prefetch_Ops
+{
+  const char* name;
+  void (*observe)(APEX_CPU* cpu, int pc, int address);
+} Prefetch_Ops;
+
+static void
+none_observe(APEX_CPU* cpu, int pc, int address)
+{
+}
+
+/* Prefetches the prefetch_degree lines after the line accessed */
+static void
+next_line_observe(APEX_CPU* cpu, int pc, int address)
+{
+  int line = cpu->caches[0].line;
+  int base = address - address % line;
+  for (int k = 1; k <= cpu->config.prefetch_degree; ++k) {
+    apex_cache_prefetch(cpu, base + k * line);
+  }
+}
+
+/*
+ * Reference prediction table indexed by pc: once an instruction repeats
+ * the same stride twice in a row, prefetches prefetch_degree strides
+ * ahead of it. The stride is replaced after two mismatches
+ */
+static void
+stride_observe(APEX_CPU* cpu, int pc, int address)
+{
+  APEX_PrefetchEntry* entry =
+    &cpu->prefetch_table[((uint32_t)pc / 4) % cpu->config.prefetch_table];
+
+  if (entry->tag != pc) {
+    entry->tag = pc;
+    entry->last = address;
+    entry->stride = 0;
+    entry->conf = 0;
+    return;
+  }
+
+  int32_t stride = address - entry->last;
+  if (stride == entry->stride) {
+    if (entry->conf < 3) {
+      entry->conf++;
+    }
+  } else if (entry->conf > 0) {
+    entry->conf--;
+  } else {
+    entry->stride = stride;
+  }
+  entry->last = address;
+
+  if (entry->conf >= 2 && entry->stride != 0) {
+    for (int k = 1; k <= cpu->config.prefetch_degree; ++k) {
+      apex_cache_prefetch(cpu, address + k * entry->stride);
+    }
+  }
+}
+
+/*
+ * Tracks runs of accesses to consecutive lines, in either direction.
+ * Once a run has advanced twice, prefetches prefetch_degree lines ahead
+ * of it. A line that continues no run starts a new one in the least
+ * recently used entry
+ */
+static void
+stream_observe(APEX_CPU* cpu, int pc, int address)
+{
+  int32_t line = address / cpu->caches[0].line;
+  APEX_PrefetchEntry* oldest = &cpu->prefetch_table[0];
+  APEX_PrefetchEntry* stream = NULL;
+
+  for (int i = 0; i < cpu->config.prefetch_table && !stream; ++i) {
+    APEX_PrefetchEntry* entry = &cpu->prefetch_table[i];
+    if (entry->tag < 0) {
+      oldest = entry;
+      continue;
+    }
+    if (entry->last == line) {
+      entry->stamp = cpu->clock;
+      return;
+    }
+    int32_t step = line - entry->last;
+    if ((step == 1 || step == -1) &&
+        (entry->stride == 0 || entry->stride == step)) {
+      stream = entry;
+    } else if (oldest->tag >= 0 &&
+               (int32_t)(entry->stamp - oldest->stamp) < 0) {
+      oldest = entry;
+    }
+  }
+
+  if (!stream) {
+    oldest->tag = 0;
+    oldest->last = line;
+    oldest->stride = 0;
+    oldest->conf = 0;
+    oldest->stamp = cpu->clock;
+    return;
+  }
+
+  stream->stride = line - stream->last;
+  stream->last = line;
+  stream->stamp = cpu->clock;
+  if (stream->conf < 3) {
+    stream->conf++;
+  }
+  if (stream->conf >= 2) {
+    int words = cpu->caches[0].line;
+    for (int k = 1; k <= cpu->config.prefetch_degree; ++k) {
+      apex_cache_prefetch(cpu, (line + k * stream->stride) * words);
+    }
+  }
+}
+
+static const Prefetch_Ops prefetch_ops[NUM_PREFETCHERS] = {
+  [PREFETCH_NONE] = { "none", none_observe },
+  [PREFETCH_NEXT_LINE] = { "next-line", next_line_observe },
+  [PREFETCH_STRIDE] = { "stride", stride_observe },
+  [PREFETCH_STREAM] = { "stream", stream_observe },
+};
+
+/*
+ * Allocates the prefetch table for the configured size, with every entry
+ * empty
+ */
+int
+apex_prefetch_create(APEX_CPU* cpu)
+{
+  cpu->prefetch_table =
+    malloc(cpu->config.prefetch_table * sizeof(*cpu->prefetch_table));
+  if (!cpu->prefetch_table) {
+    return -1;
+  }
+
+  for (int i = 0; i < cpu->config.prefetch_table; ++i) {
+    cpu->prefetch_table[i].tag = -1;
+    cpu->prefetch_table[i].last = 0;
+    cpu->prefetch_table[i].stride = 0;
+    cpu->prefetch_table[i].stamp = 0;
+    cpu->prefetch_table[i].conf = 0;
+  }
+  return 0;
+}
+
+void
+apex_prefetch_free(APEX_CPU* cpu)
+{
+  free(cpu->prefetch_table);
+}
+
+/*
+ * Trains the prefetcher with a demand access to data memory word
+ * 'address' by the instruction at 'pc', which may issue prefetches.
+ * Prefetchers need the L1D and its MSHRs
+ */
+void
+apex_prefetch_observe(APEX_CPU* cpu, int pc, int address)
+{
+  if (cpu->num_mshrs == 0) {
+    return;
+  }
+  prefetch_ops[cpu->config.prefetcher].observe(cpu, pc, address);
+}
+
+static double
+percent(long part, long whole)
+{
+  return whole ? 100.0 * part / whole : 0.0;
+}
+
+/*
+ * Prints how many prefetches were issued and how well they did: accuracy
+ * is the share of them demand accesses used, coverage the share of the
+ * lines loads missed in the L1D they fetched instead, and timeliness the
+ * share of the used ones that arrived before the access
+ */
+void
+apex_prefetch_report(APEX_CPU* cpu)
+{
+  if (cpu->config.prefetcher == PREFETCH_NONE || cpu->num_mshrs == 0) {
+    return;
+  }
+
+  const APEX_PrefetchStats* stats = &cpu->prefetch_stats;
+  long timely = stats->useful - stats->late;
+  long misses = cpu->mshr_stats.primary;
+
+  printf("\n");
+  printf("==================PREFETCHER==============\n");
+  printf(" | Prefetcher       | %s, degree %d, %d table entries |\n",
+         prefetch_ops[cpu->config.prefetcher].name,
+         cpu->config.prefetch_degree, cpu->config.prefetch_table);
+  printf(" | Prefetches       | %ld issued, %ld dropped with MSHRs full |\n",
+         stats->issued, stats->dropped);
+  printf(" | Accuracy         | %.2f%% (%ld used, %ld evicted unused) |\n",
+         percent(stats->useful, stats->issued), stats->useful,
+         stats->unused);
+  printf(" | Coverage         | %.2f%% of %ld L1D load misses |\n",
+         percent(stats->useful, stats->useful + misses),
+         stats->useful + misses);
+  printf(" | Timeliness       | %.2f%% (%ld late) |\n",
+         percent(timely, stats->useful), stats->late);
+}
@@ -0,0 +1,161 @@
+/*
+ *  sample.c
+ *  Contains the sampled simulation driver: the program is skipped over
+ *  functionally and measured in short cycle accurate windows, and the
+ *  window statistics are reported with confidence intervals
+ *
+ *  Author :
+ *
+ *  State University of New York, Binghamton
+ */
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cpu.h"
+
+/* Two sided 95% Student t values for 1..30 degrees of freedom */
+static const double t_95[] = {
+  12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+  2.201,  2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+  2.080,  2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+};
+
+#define T_95_ENTRIES (int)(sizeof(t_95) / sizeof(t_95[0]))
+
+/* Running sums of a per-window metric */
+typedef struct Sample_Sum
+{
+  double sum;
+  double sum_sq;
+} Sample_Sum;
+
+static void
+sum_add(Sample_Sum* s, double x)
+{
+  s->sum += x;
+  s->sum_sq += x * x;
+}
+
+/*
+ * Mean of n windows, and the half width of its 95% confidence interval
+ * (-1 with fewer than two windows)
+ */
+static double
+sum_mean(const Sample_Sum* s, int n, double* ci)
+{
+  *ci = -1;
+  if (n == 0) {
+    return 0;
+  }
+
+  double mean = s->sum / n;
+  if (n > 1) {
+    double var = (s->sum_sq - n * mean * mean) / (n - 1);
+    double t = n - 1 <= T_95_ENTRIES ? t_95[n - 2] : 1.96;
+    *ci = t * sqrt(var > 0 ? var : 0) / sqrt(n);
+  }
+  return mean;
+}
+
+/*
+ * Runs the program as repeated samples of
+ *   skip    instructions executed functionally,
+ *   warmup  cycles simulated in detail to refill the pipeline,
+ *   window  cycles simulated in detail and measured,
+ * after which the pipeline is drained for the next skip. Stops when the
+ * program finishes, or once 'max_cycles' cycles (if not 0) have been
+ * simulated in detail. Returns the number of measured windows, or -1 for
+ * an empty window
+ */
+int
+APEX_cpu_sample(APEX_CPU* cpu,
+                long skip,
+                int warmup,
+                int window,
+                long max_cycles,
+                APEX_SampleStats* stats)
+{
+  Sample_Sum ipc = { 0, 0 };
+  Sample_Sum stall[NUM_STALLS];
+  memset(stall, 0, sizeof(stall));
+  memset(stats, 0, sizeof(*stats));
+  if (window <= 0) {
+    return -1;
+  }
+
+  long start_ff = cpu->ins_fast_forwarded;
+  long start_completed = cpu->ins_completed;
+  int start_clock = cpu->clock;
+
+  while (!APEX_cpu_finished(cpu) &&
+         (max_cycles <= 0 || cpu->clock - start_clock < max_cycles)) {
+    if (skip > 0 && APEX_cpu_fast_forward(cpu, skip, -1) < 0) {
+      break;
+    }
+    if (warmup > 0) {
+      APEX_cpu_simulate(cpu, warmup);
+    }
+    if (APEX_cpu_finished(cpu)) {
+      break;
+    }
+
+    int completed = cpu->ins_completed;
+    long stalls[NUM_STALLS];
+    memcpy(stalls, cpu->stalls, sizeof(stalls));
+
+    int cycles = APEX_cpu_simulate(cpu, window);
+    if (cycles > 0) {
+      stats->samples++;
+      stats->measured_cycles += cycles;
+      sum_add(&ipc, (double)(cpu->ins_completed - completed) / cycles);
+      for (int i = 0; i < NUM_STALLS; ++i) {
+        sum_add(&stall[i], (double)(cpu->stalls[i] - stalls[i]) / cycles);
+      }
+    }
+
+    APEX_cpu_drain(cpu);
+  }
+
+  stats->instructions = (cpu->ins_fast_forwarded - start_ff) +
+                        (cpu->ins_completed - start_completed);
+  stats->detailed_cycles = cpu->clock - start_clock;
+  stats->ipc = sum_mean(&ipc, stats->samples, &stats->ipc_ci);
+  for (int i = 0; i < NUM_STALLS; ++i) {
+    stats->stall[i] = sum_mean(&stall[i], stats->samples, &stats->stall_ci[i]);
+  }
+  return stats->samples;
+}
+
+static void
+print_estimate(const char* name, double mean, double ci)
+{
+  if (ci < 0) {
+    printf(" | %-16s | %8.4f | +/- n/a    |\n", name, mean);
+  } else {
+    printf(" | %-16s | %8.4f | +/- %-6.4f |\n", name, mean, ci);
+  }
+}
+
+/*
+ * Prints the estimates of a sampled simulation
+ */
+void
+APEX_sample_report(const APEX_SampleStats* stats)
+{
+  printf("\n");
+  printf("==================SAMPLED ESTIMATES==============\n");
+  printf(" | Windows measured | %d |\n", stats->samples);
+  printf(" | Instructions     | %ld |\n", stats->instructions);
+  printf(" | Detailed cycles  | %ld (%ld measured) |\n",
+         stats->detailed_cycles, stats->measured_cycles);
+  print_estimate("IPC", stats->ipc, stats->ipc_ci);
+  if (stats->ipc > 0) {
+    printf(" | Estimated cycles | %.0f |\n", stats->instructions / stats->ipc);
+  }
+  for (int i = 0; i < NUM_STALLS; ++i) {
+    char name[32];
+    snprintf(name, sizeof(name), "stall %s", apex_stall_names[i]);
+    print_estimate(name, stats->stall[i], stats->stall_ci[i]);
+  }
+}
@@ -0,0 +1,3 @@
+MOVC,R1,#5
+LOAD,R2,R1,#0
+HALT,
@@ -0,0 +1,106 @@
+/*
+ *  timing_test.c
+ *  Checks of the cycle counts of the pipeline: models that should give
+ *  the same timing must agree cycle for cycle. Run with 'make test' from
+ *  the project directory
+ *
+ *  Author :
+ *
+ *  State University of New York, Binghamton
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../cpu.h"
+
+static int failures;
+
+/*
+ * Simulates 'program' to the end with the parameters in 'args' on top of
+ * the defaults, printing every cycle if 'debug' is set (which also
+ * disables cycle skipping). Returns the number of cycles, or -1
+ */
+static int
+run(const char* program, int debug, int argc, const char* args[])
+{
+  APEX_Config config;
+  apex_config_default(&config);
+  if (apex_config_args(&config, argc, args) != argc) {
+    return -1;
+  }
+
+  APEX_CPU* cpu = APEX_cpu_init(program, &config);
+  if (!cpu) {
+    return -1;
+  }
+  cpu->debug = debug;
+
+  /* Display output is not checked */
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  int null = open("/dev/null", O_WRONLY);
+  dup2(null, STDOUT_FILENO);
+  close(null);
+  int cycles = APEX_cpu_simulate(cpu, 0);
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+
+  APEX_cpu_stop(cpu);
+  return cycles;
+}
+
+static void
+expect_equal(const char* what, int a, int b)
+{
+  if (a < 0 || a != b) {
+    printf("FAIL %s: %d cycles vs %d\n", what, a, b);
+    failures++;
+  } else {
+    printf("ok   %s: %d cycles\n", what, a);
+  }
+}
+
+/* A load missing every level takes as long whether it blocks its MEM
+ * unit or waits in an MSHR
+ */
+static void
+test_lone_miss(void)
+{
+  const char* blocking[] = { "l1d_size=16", "memory_latency=10", "mshrs=0" };
+  const char* one[] = { "l1d_size=16", "memory_latency=10", "mshrs=1" };
+  const char* four[] = { "l1d_size=16", "memory_latency=10", "mshrs=4" };
+  const char* program = "tests/lone_miss.asm";
+  int cycles = run(program, 0, 3, blocking);
+
+  expect_equal("lone miss, 1 MSHR vs blocking", run(program, 0, 3, one),
+               cycles);
+  expect_equal("lone miss, 4 MSHRs vs blocking", run(program, 0, 3, four),
+               cycles);
+}
+
+/* Skipping the cycles a blocking load waits for the data cache gives the
+ * same count as simulating them one by one in display mode
+ */
+static void
+test_blocking_skip(void)
+{
+  const char* caches[] = { "l1d_size=64", "l2_size=256",
+                           "memory_latency=100", "mshrs=0" };
+
+  expect_equal("lone blocking miss, skipped vs displayed",
+               run("tests/lone_miss.asm", 0, 4, caches),
+               run("tests/lone_miss.asm", 1, 4, caches));
+  expect_equal("array walk with blocking misses, skipped vs displayed",
+               run("tests/walk.asm", 0, 4, caches),
+               run("tests/walk.asm", 1, 4, caches));
+}
+
+int
+main(void)
+{
+  test_lone_miss();
+  test_blocking_skip();
+  return failures ? 1 : 0;
+}
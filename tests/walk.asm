@@ -0,0 +1,11 @@
+MOVC,R1,#0
+MOVC,R2,#800
+MOVC,R5,#0
+LOAD,R3,R1,#0
+LOAD,R4,R1,#1
+ADD,R5,R5,R3
+ADD,R5,R5,R4
+ADDL,R1,R1,#2
+SUB,R6,R1,R2
+BNZ,#-24
+HALT,